@@ -28,6 +28,7 @@
 #include <sys/console.h>
 #include <sys/systm.h>
 #include <sys/malloc.h>
+#include <sys/sem.h>
 #include <sys/thread.h>
 
 #include <dev/display/panel.h>
@@ -41,6 +42,26 @@
 #include "gpio.h"
 #include "gcode.h"
 #include "pnp.h"
+#include "settings.h"
+#include "uart.h"
+
+/* Cortex-M4 DWT cycle counter. */
+#define	CM4_DEMCR		0xE000EDFC
+#define	 DEMCR_TRCENA		(1 << 24)
+#define	CM4_DWT_CTRL		0xE0001000
+#define	 DWT_CTRL_CYCCNTENA	(1 << 0)
+#define	CM4_DWT_CYCCNT		0xE0001004
+
+/* USART1 is on APB2, 168MHz / PPRE2_4. */
+#define	BOARD_USART_CLK		42000000
+#define	BOARD_BAUD_DEFAULT	115200
+#define	BOARD_USART_SR		0x00
+#define	 USART_SR_TC		(1 << 6)
+#define	BOARD_USART_BRR		0x08
+
+/* UART4 carries the log, on APB1, 168MHz / PPRE1_4. */
+#define	BOARD_DEBUG_CLK		42000000
+#define	BOARD_DEBUG_BAUD	921600
 
 static struct stm32f4_usart_softc usart_sc;
 static struct stm32f4_flash_softc flash_sc;
@@ -49,6 +70,11 @@ static struct stm32f4_rcc_softc rcc_sc;
 static struct stm32f4_timer_softc timer_sc;
 static struct stm32f4_rng_softc rng_sc;
 static struct arm_nvic_softc nvic_sc;
+static struct uart_tx uart_tx;
+static struct stm32f4_usart_softc debug_sc;
+static struct uart_tx debug_tx;
+static int debug_ready;
+static uint32_t board_baud;
 static struct mdx_device dev_nvic = { .sc = &nvic_sc };
 
 struct stm32f4_dma_softc dma1_sc;
@@ -91,6 +117,148 @@ uart_putchar(int c, void *arg)
 	stm32f4_usart_putc(sc, c);
 }
 
+/* Once interrupts are up the console is sent by DMA. */
+static void
+uart_dma_putchar(int c, void *arg)
+{
+	struct uart_tx *tx;
+
+	tx = arg;
+
+	if (c == '\n')
+		uart_tx_putc(tx, '\r');
+
+	uart_tx_putc(tx, c);
+}
+
+static void
+uart_dma_intr(void *arg, int irq)
+{
+
+	uart_tx_intr(arg);
+}
+
+/*
+ * Console characters dropped as the TX ring was full, by an interrupt
+ * handler that could not wait for room.
+ */
+uint32_t
+board_console_overflows(void)
+{
+
+	return (uart_tx.overflows);
+}
+
+/* Log characters dropped as the diagnostics port could not keep up. */
+uint32_t
+board_debug_overflows(void)
+{
+
+	return (debug_tx.overflows);
+}
+
+/* Raw bytes, sent as one piece, for binary replies. */
+void
+board_console_write(const uint8_t *buf, int len)
+{
+
+	uart_tx_write(&uart_tx, buf, len);
+}
+
+/* The same, but only between lines, see uart_tx_write_line(). */
+int
+board_console_write_line(const uint8_t *buf, int len)
+{
+
+	return (uart_tx_write_line(&uart_tx, buf, len));
+}
+
+/*
+ * Text for the diagnostics port, sent as one piece.  Returns -1 until
+ * the port is up.
+ */
+int
+board_debug_write(const uint8_t *buf, int len)
+{
+
+	if (debug_ready == 0)
+		return (-1);
+
+	uart_tx_write(&debug_tx, buf, len);
+
+	return (0);
+}
+
+void
+board_console_flush(void)
+{
+
+	uart_tx_flush(&uart_tx);
+}
+
+/*
+ * USART1 divider for the baud rate, 16x oversampling.  0 if the rate is
+ * off by more than 2%, or above the 2.625 Mbaud the clock allows.
+ */
+static uint32_t
+board_baud_brr(uint32_t baud)
+{
+	uint32_t real;
+	uint32_t brr;
+
+	if (baud < 1200)
+		return (0);
+
+	brr = (BOARD_USART_CLK + baud / 2) / baud;
+	if (brr < 16)
+		return (0);
+
+	real = BOARD_USART_CLK / brr;
+	if ((real > baud ? real - baud : baud - real) > baud / 50)
+		return (0);
+
+	return (brr);
+}
+
+int
+board_baud_valid(uint32_t baud)
+{
+
+	return (board_baud_brr(baud) != 0);
+}
+
+/*
+ * Switch USART1 to another rate once everything queued has been sent.
+ * The receive DMA stream keeps running, what comes in meanwhile is
+ * garbage the caller has to skip.
+ */
+int
+board_set_baud(uint32_t baud)
+{
+	uint32_t brr;
+
+	brr = board_baud_brr(baud);
+	if (brr == 0)
+		return (-1);
+
+	uart_tx_flush(&uart_tx);
+	while ((*(volatile uint32_t *)(USART1_BASE + BOARD_USART_SR) &
+	    USART_SR_TC) == 0)
+		;
+
+	*(volatile uint32_t *)(USART1_BASE + BOARD_USART_BRR) = brr;
+	board_baud = baud;
+
+	return (0);
+}
+
+uint32_t
+board_get_baud(void)
+{
+
+	return (board_baud);
+}
+
 uint32_t
 board_get_random(void)
 {
@@ -106,6 +274,13 @@ board_get_random(void)
 	return (data);
 }
 
+uint32_t
+board_get_cycles(void)
+{
+
+	return (*(volatile uint32_t *)CM4_DWT_CYCCNT);
+}
+
 void
 board_init(void)
 {
@@ -128,32 +303,56 @@ board_init(void)
 	reg = (GPIOAEN | GPIOBEN | GPIOCEN | GPIODEN | GPIOEEN);
 	reg |= DMA1EN | DMA2EN;
 	stm32f4_rcc_setup(&rcc_sc, reg, RNGEN, 0,
-	    (TIM12EN | TIM13EN | TIM14EN | TIM4EN),
+	    (TIM12EN | TIM13EN | TIM14EN | TIM4EN | UART4EN),
 	    (TIM1EN | TIM8EN | TIM10EN | USART1EN));
 	stm32f4_gpio_init(&gpio_sc, GPIO_BASE);
 	gpio_config(&gpio_sc);
 
-	stm32f4_usart_init(&usart_sc, USART1_BASE, 42000000, 115200);
+	/* The rate last agreed on with the host, see M575. */
+	board_baud = BOARD_BAUD_DEFAULT;
+	if (settings_load() == 0 && board_baud_brr(settings_get()->baud))
+		board_baud = settings_get()->baud;
+
+	stm32f4_usart_init(&usart_sc, USART1_BASE, BOARD_USART_CLK,
+	    board_baud);
 	mdx_console_register(uart_putchar, (void *)&usart_sc);
 	stm32f4_usart_setup_receiver(&usart_sc, 1, NULL);
 
 	printf("MDEPX is starting up\n");
 
+	/* Cycle counter is used for timing measurements. */
+	*(volatile uint32_t *)CM4_DEMCR |= DEMCR_TRCENA;
+	*(volatile uint32_t *)CM4_DWT_CYCCNT = 0;
+	*(volatile uint32_t *)CM4_DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+
 	stm32f4_rng_init(&rng_sc, RNG_BASE);
 	arm_nvic_init(&dev_nvic, NVIC_BASE);
 
 	stm32f4_dma_init(&dma1_sc, DMA1_BASE);
 	stm32f4_dma_init(&dma2_sc, DMA2_BASE);
 
-#if 0
-	/* DMA2 Stream2 */
-	mdx_intc_setup(&dev_nvic, 58, stm32f4_dma_intr, &dma2_sc);
+	/* USART1: idle line after received data. */
+	mdx_intc_setup(&dev_nvic, 37, gcode_usart_intr, &usart_sc);
+	mdx_intc_enable(&dev_nvic, 37);
+
+	/* DMA2 Stream2 (USART1_RX) */
+	mdx_intc_setup(&dev_nvic, 58, gcode_dma_intr, &dma2_sc);
 	mdx_intc_enable(&dev_nvic, 58);
 
-	/* DMA2 Stream7 */
-	mdx_intc_setup(&dev_nvic, 70, stm32f4_dma_intr, &dma2_sc);
+	/* DMA2 Stream7 (USART1_TX) */
+	/* Replies to the host wait for room, they may not get lost. */
+	uart_tx_init(&uart_tx, USART1_BASE, DMA2_BASE, 7, 4, 1);
+	mdx_intc_setup(&dev_nvic, 70, uart_dma_intr, &uart_tx);
 	mdx_intc_enable(&dev_nvic, 70);
-#endif
+	mdx_console_register(uart_dma_putchar, (void *)&uart_tx);
+
+	/* DMA1 Stream4 (UART4_TX): the log, off the host link. */
+	stm32f4_usart_init(&debug_sc, UART4_BASE, BOARD_DEBUG_CLK,
+	    BOARD_DEBUG_BAUD);
+	uart_tx_init(&debug_tx, UART4_BASE, DMA1_BASE, 4, 4, 0);
+	mdx_intc_setup(&dev_nvic, 15, uart_dma_intr, &debug_tx);
+	mdx_intc_enable(&dev_nvic, 15);
+	debug_ready = 1;
 
 	malloc_init();
 	malloc_add_region((void *)MALLOC_REGION_START, MALLOC_REGION_SIZE);
@@ -177,6 +376,10 @@ board_init(void)
 	mdx_intc_setup(&dev_nvic, 30, pnp_pwm_y_intr, &pwm_y_sc);
 	mdx_intc_enable(&dev_nvic, 30);
 
+	/* Y L/R step periods: DMA1 Stream6 (TIM4_UP) */
+	mdx_intc_setup(&dev_nvic, 17, pnp_dma_y_intr, &dma1_sc);
+	mdx_intc_enable(&dev_nvic, 17);
+
 	/* Z Motors: TIM14 CH1 */
 	stm32f4_pwm_init(&pwm_z_sc, TIM14_BASE, 84000000);
 	mdx_intc_setup(&dev_nvic, 45, pnp_pwm_z_intr, &pwm_z_sc);
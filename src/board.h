@@ -30,6 +30,8 @@
 #define	MALLOC_REGION_START	0x20010000
 #define	MALLOC_REGION_SIZE	0x00010000 /* 64kb */
 
+#define	BOARD_CPU_FREQ		168000000
+
 extern struct stm32f4_dma_softc dma1_sc;
 extern struct stm32f4_dma_softc dma2_sc;
 extern struct stm32f4_gpio_softc gpio_sc;
@@ -40,5 +42,15 @@ extern struct stm32f4_pwm_softc pwm_h1_sc;
 extern struct stm32f4_pwm_softc pwm_h2_sc;
 
 uint32_t board_get_random(void);
+uint32_t board_get_cycles(void);
+uint32_t board_console_overflows(void);
+uint32_t board_debug_overflows(void);
+int board_baud_valid(uint32_t baud);
+int board_set_baud(uint32_t baud);
+uint32_t board_get_baud(void);
+void board_console_write(const uint8_t *buf, int len);
+int board_console_write_line(const uint8_t *buf, int len);
+int board_debug_write(const uint8_t *buf, int len);
+void board_console_flush(void);
 
 #endif /* !_SRC_BOARD_H_ */
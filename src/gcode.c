@@ -35,39 +35,403 @@
 
 #include "board.h"
 #include "gcode.h"
+#include "log.h"
 #include "pnp.h"
+#include "sensor.h"
+#include "settings.h"
+#include "shaper.h"
 
-#define	GCODE_DEBUG
-#undef	GCODE_DEBUG
-
-#ifdef	GCODE_DEBUG
-#define	dprintf(fmt, ...)	printf(fmt, ##__VA_ARGS__)
-#else
-#define	dprintf(fmt, ...)
-#endif
+#define	lprintf(level, fmt, ...)	\
+	log_printf(LOG_GCODE, (level), fmt, ##__VA_ARGS__)
 
 #define	DMA_BUF_SIZE	4096
 #define	MAX_GCODE_LEN	256
 
-static uint8_t dma_buffer[DMA_BUF_SIZE];
-static uint8_t cmd_buffer[MAX_GCODE_LEN];
-static int cmd_buffer_ptr;
+/*
+ * USART1 receives into dma_buffer through DMA2 Stream2.  The G-code
+ * thread is woken when the line goes idle after a burst, and at each half
+ * of the buffer so that a long burst does not overrun it.
+ */
+#define	GCODE_RX_STREAM		2
+
+#define	RD4(_base, _reg)	(*(volatile uint32_t *)((_base) + (_reg)))
+#define	WR4(_base, _reg, _val)	\
+	(*(volatile uint32_t *)((_base) + (_reg)) = (_val))
+
+#define	GC_USART_SR		0x00
+#define	 USART_SR_IDLE		(1 << 4)
+#define	GC_USART_DR		0x04
+#define	GC_USART_CR1		0x0C
+#define	 USART_CR1_IDLEIE	(1 << 4)
+
+#define	GC_DMA_LISR		0x00
+#define	GC_DMA_LIFCR		0x08
+#define	GC_DMA_SCR(n)		(0x10 + 0x18 * (n))
+#define	 DMA_SCR_HTIE		(1 << 3)
+#define	 DMA_SCR_TCIE		(1 << 4)
+#define	 DMA_FLAGS_ALL		0x3d	/* FEIF | DMEIF | TEIF | HTIF | TCIF */
+#define	GC_DMA_SHIFT		16	/* Flags of stream 2. */
+
+/*
+ * Commands accepted ahead of the one executing.  Each one is
+ * acknowledged once it is in the queue, so the host can send the next
+ * while the machine moves.  A full queue holds the acknowledge back.
+ *
+ * Every line gets one of two replies.  A line that is taken gets OK,
+ * and COMPLETE once it has run, commands done right away included.
+ * A line that can't be taken gets ERROR in place of the OK, and one
+ * that fails as it runs ERROR in place of the COMPLETE.  The reason is
+ * printed on a line of its own before the ERROR.
+ */
+#define	GCODE_QUEUE_DEPTH	16
+
+struct gcode_queue {
+	struct gcode_command cmds[GCODE_QUEUE_DEPTH];
+	int head;
+	int tail;
+	mdx_sem_t free_sem;
+	mdx_sem_t used_sem;
+	mdx_sem_t drain_sem;
+	volatile int flush;	/* Drop commands, see gcode_reset(). */
+	int macro_error;	/* A line of the macro running failed. */
+};
+
+/* What a command handler that runs right away returns. */
+#define	GCODE_DONE		0	/* Replied to by the caller. */
+#define	GCODE_QUEUED		1	/* The executor replies. */
+
+/*
+ * Macros: M820 Q<n> <line>|<line>|... defines macro n, M821 Q<n> runs
+ * it and M822 saves all of them to flash.  A bare X, Y, Z, I or J in a
+ * line of the macro is a parameter, it takes the value given to M821,
+ * or is left out if M821 does not give one.  The lines are kept parsed
+ * here and as text in the settings, as that survives a change of
+ * struct gcode_command.
+ */
+#define	GCODE_MACROS		SETTINGS_MACROS
+#define	GCODE_MACRO_STEPS	10
+
+struct gcode_macro {
+	struct gcode_command steps[GCODE_MACRO_STEPS];
+	int nsteps;
+};
+
+static struct gcode_macro macros[GCODE_MACROS];
+
+/* G4 sleeps in slices of this, us. */
+#define	GCODE_DWELL_SLICE	100000
+
+/* Axis letters in reports, by PNP_AXIS_*. */
+static const char *gcode_axes = "XYZIJ";
+
+/*
+ * Numbers are fixed-point in millionths: nanometers for mm, micro
+ * degrees for degrees.  Digits past that are rounded off.  Positions
+ * have to fit 32 bits, feed rates may be larger.
+ */
+#define	GCODE_FIXED_ONE		1000000
+#define	GCODE_FIXED_DIGITS	6
+#define	GCODE_FIXED_MAX		1000000000000000LL
+#define	GCODE_POS_MAX		0x7fffffffLL
+
+/*
+ * A line in the receive ring, parsed where it is.  It is made of two
+ * pieces if it wraps around the end of the ring.
+ */
+struct gcode_span {
+	const uint8_t *buf[2];
+	int len[2];
+};
+
+/*
+ * Binary protocol, entered with M801 and left with a GCODE_BIN_TEXT
+ * frame.  Frames from the host:
+ *
+ *	0xA5, length, sequence, type, payload[length], CRC-16 (LE)
+ *
+ * Integers are little-endian.  The CRC is CRC-16/CCITT-FALSE over all
+ * but the sync byte.  Replies are six bytes:
+ *
+ *	0xA6, sequence, code, argument, CRC-16 (LE)
+ *
+ * Each frame is acknowledged once queued, like a text line, and gets a
+ * GCODE_ACK_DONE when it has been executed, or GCODE_ACK_FAIL if that
+ * failed.  A frame that repeats the sequence of the last one is
+ * acknowledged again but not executed.
+ * Neither sync byte is ASCII, so text logs in between can be skipped.
+ */
+#define	GCODE_BIN_SYNC		0xA5
+#define	GCODE_BIN_HDR		4
+#define	GCODE_BIN_CRC		2
+
+#define	GCODE_BIN_MOVE		1	/* Mask, int32 per set bit. */
+#define	 BIN_MOVE_X		(1 << 0)	/* nm */
+#define	 BIN_MOVE_Y		(1 << 1)	/* nm */
+#define	 BIN_MOVE_Z		(1 << 2)	/* nm */
+#define	 BIN_MOVE_H1		(1 << 3)	/* udeg */
+#define	 BIN_MOVE_H2		(1 << 4)	/* udeg */
+#define	 BIN_MOVE_F		(1 << 5)	/* mm/min * 1000 */
+#define	GCODE_BIN_ACTUATE	2	/* Target, value. */
+#define	GCODE_BIN_SENSOR	3	/* Sensor. */
+#define	GCODE_BIN_WAIT		4	/* As M400. */
+#define	GCODE_BIN_TEXT		5	/* Back to text. */
+
+#define	GCODE_ACK_SYNC		0xA6
+#define	GCODE_ACK_OK		0	/* Queued. */
+#define	GCODE_ACK_DONE		1	/* Executed. */
+#define	GCODE_ACK_VALUE		2	/* Sensor value in the argument. */
+#define	GCODE_ACK_CRC		3	/* Bad CRC, send again. */
+#define	GCODE_ACK_BAD		4	/* Unknown or malformed frame. */
+#define	GCODE_ACK_EVENT		5	/* Sensor, unasked: (n << 4) | value. */
+#define	GCODE_ACK_FAIL		6	/* Failed as it was executed. */
+
+/*
+ * M575 B<rate>: after the OK the host has GCODE_BAUD_WAIT to send a line
+ * ending in M575 at the new rate, or the old one is back.
+ */
+#define	GCODE_BAUD_WAIT		2000000		/* us */
+#define	GCODE_BAUD_POLL		10000		/* us */
+
+/*
+ * Realtime commands, taken out of the stream by the receive interrupt
+ * before the parser sees them, so they act even while it is blocked
+ * behind a full queue.  Not recognized in binary mode.
+ */
+#define	GCODE_RT_STATUS		'?'
+#define	GCODE_RT_HOLD		'!'
+#define	GCODE_RT_RESUME		'~'
+#define	GCODE_RT_ABORT		0x18	/* Ctrl-X */
+
+/*
+ * Numbered lines, for links that drop bits: "N<line> <command>*<sum>",
+ * where sum is the XOR of the bytes before the '*' as with Marlin, or
+ * "N<line> <command>^<crc>" with the CRC-16 of the binary frames.  Each
+ * line number has to be the last one plus one.  A line that fails is
+ * dropped and its number asked for again with "Resend: <line>", one
+ * that was taken already is acknowledged and ignored, so the host only
+ * needs to send the bad line again.  M110 [N<line>] sets the last line.
+ * The sum comes before a ';' comment, a line without the N has none.
+ */
+#define	GCODE_SUM_XOR		'*'
+#define	GCODE_SUM_CRC		'^'
+
+/* Receive ring state. */
+struct gcode_rx {
+	int line;		/* Start of the current line or frame. */
+	int scan;		/* Scanned up to. */
+	int discard;		/* The current line is too long. */
+	int binary;		/* Frames instead of lines. */
+	int last_seq;		/* Of the last binary frame taken. */
+	volatile int ready;	/* Checked for realtime commands up to. */
+	volatile int abort;	/* Ctrl-X seen, reset the parser. */
+	int line_no;		/* Last numbered line taken. */
+	int numbered;		/* Numbered lines are in use. */
+};
+
+static uint8_t dma_buffer[DMA_BUF_SIZE] __aligned(4);
+static struct gcode_rx rx;
+static struct gcode_queue queue;
+static mdx_sem_t rx_sem;
+static mdx_sem_t status_sem;
+
+/*
+ * M154: the status report goes out every report_us by itself, 0 if only
+ * on '?'.
+ */
+#define	GCODE_REPORT_MIN	10000		/* us */
+#define	GCODE_REPORT_MAX	60000000	/* us */
+
+static volatile int report_us;
+
+/* A line of output waits this long for the console to be between lines. */
+#define	GCODE_LINE_WAIT		1000		/* us */
+#define	GCODE_LINE_TRIES	20
+
+/* Write position of the receive DMA in the ring. */
+static int
+gcode_rx_cnt(void)
+{
+	uint32_t cnt;
+
+	cnt = stm32f4_dma_getcnt(&dma2_sc, GCODE_RX_STREAM);
+
+	return ((DMA_BUF_SIZE - cnt) % DMA_BUF_SIZE);
+}
+
+/*
+ * Act on the realtime commands received since the last interrupt.  They
+ * are blanked out in the ring, the parser skips spaces.
+ */
+static void
+gcode_realtime(void)
+{
+	int cnt;
+	int i;
+
+	critical_enter();
+
+	cnt = gcode_rx_cnt();
+
+	for (i = rx.ready; i != cnt && rx.binary == 0;
+	    i = (i + 1) % DMA_BUF_SIZE) {
+		switch (dma_buffer[i]) {
+		case GCODE_RT_STATUS:
+			mdx_sem_post(&status_sem);
+			break;
+		case GCODE_RT_HOLD:
+			pnp_hold();
+			break;
+		case GCODE_RT_RESUME:
+			pnp_resume();
+			break;
+		case GCODE_RT_ABORT:
+			pnp_abort();
+			queue.flush = 1;
+			rx.abort = 1;
+			break;
+		default:
+			continue;
+		}
+		dma_buffer[i] = ' ';
+	}
+
+	rx.ready = cnt;
+
+	critical_exit();
+}
+
+/* USART1 global interrupt: the line went idle after some data. */
+void
+gcode_usart_intr(void *arg, int irq)
+{
+
+	if (RD4(USART1_BASE, GC_USART_SR) & USART_SR_IDLE) {
+		/* Cleared by the read of SR followed by DR. */
+		(void)RD4(USART1_BASE, GC_USART_DR);
+		gcode_realtime();
+		mdx_sem_post(&rx_sem);
+	}
+}
+
+/* DMA2 Stream2 interrupt: half or all of the buffer is filled. */
+void
+gcode_dma_intr(void *arg, int irq)
+{
+	uint32_t flags;
+
+	flags = (RD4(DMA2_BASE, GC_DMA_LISR) >> GC_DMA_SHIFT) & DMA_FLAGS_ALL;
+	WR4(DMA2_BASE, GC_DMA_LIFCR, flags << GC_DMA_SHIFT);
+
+	gcode_realtime();
+	mdx_sem_post(&rx_sem);
+}
+
+/* CRC-16/CCITT-FALSE, one byte at a time. */
+static uint16_t
+gcode_crc16(uint16_t crc, uint8_t b)
+{
+	int i;
+
+	crc ^= (uint16_t)b << 8;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+
+	return (crc);
+}
+
+static void
+gcode_bin_reply(int seq, int code, int arg)
+{
+	uint8_t buf[6];
+	uint16_t crc;
+	int i;
+
+	buf[0] = GCODE_ACK_SYNC;
+	buf[1] = seq;
+	buf[2] = code;
+	buf[3] = arg;
+
+	crc = 0xffff;
+	for (i = 1; i < 4; i++)
+		crc = gcode_crc16(crc, buf[i]);
+	buf[4] = crc & 0xff;
+	buf[5] = crc >> 8;
+
+	board_console_write(buf, sizeof(buf));
+}
+
+/* The command is taken: OK, or a GCODE_ACK_OK frame. */
+static void
+gcode_ack(struct gcode_command *cmd)
+{
 
+	if (cmd->binary)
+		gcode_bin_reply(cmd->seq, GCODE_ACK_OK, 0);
+	else
+		printf("OK\n");
+	cmd->acked = 1;
+}
+
+/*
+ * The command is over: COMPLETE, with the OK first if it has not gone
+ * out yet, or ERROR if it failed.
+ */
 static void
+gcode_reply(struct gcode_command *cmd, int error)
+{
+
+	if (cmd->binary) {
+		if (error)
+			gcode_bin_reply(cmd->seq, cmd->acked ?
+			    GCODE_ACK_FAIL : GCODE_ACK_BAD, 0);
+		else {
+			if (cmd->acked == 0)
+				gcode_ack(cmd);
+			gcode_bin_reply(cmd->seq, GCODE_ACK_DONE, 0);
+		}
+		return;
+	}
+
+	if (error) {
+		printf("ERROR\n");
+		return;
+	}
+
+	if (cmd->acked == 0)
+		gcode_ack(cmd);
+	printf("COMPLETE\n");
+}
+
+static int
 gcode_command_sensor_read(struct gcode_command *cmd)
 {
 	int val;
 
+	/* Read it where the moves queued so far have left the machine. */
+	pnp_sync();
+
 	if (cmd->sensor_read_target == 1) {
 		val = pin_get(&gpio_sc, PORT_B, 3) ? 0 : 1;
-		printf("ok V:%d\n", val);
+		if (cmd->binary)
+			gcode_bin_reply(cmd->seq, GCODE_ACK_VALUE, val);
+		else
+			printf("ok V:%d\n", val);
 	} else if (cmd->sensor_read_target == 2) {
 		val = pin_get(&gpio_sc, PORT_D, 4) ? 0 : 1;
-		printf("ok W:%d\n", val);
+		if (cmd->binary)
+			gcode_bin_reply(cmd->seq, GCODE_ACK_VALUE, val);
+		else
+			printf("ok W:%d\n", val);
+	} else {
+		lprintf(LOG_ERR, "ERR: no sensor %d\n",
+		    cmd->sensor_read_target);
+		return (-1);
 	}
+
+	return (0);
 }
 
-static void
+static int
 gcode_command_actuate(struct gcode_command *cmd)
 {
 	int cur;
@@ -75,6 +439,8 @@ gcode_command_actuate(struct gcode_command *cmd)
 
 	val = cmd->actuate_value ? 1 : 0;
 
+	pnp_sync();
+
 	switch (cmd->actuate_target) {
 	case PNP_ACTUATE_TARGET_PUMP:
 		pin_set(&gpio_sc, PORT_B, 13, val);
@@ -97,9 +463,11 @@ gcode_command_actuate(struct gcode_command *cmd)
 	case PNP_ACTUATE_TARGET_NEEDLE:
 		cur = pin_get(&gpio_sc, PORT_B, 5);
 		if (cur && val) {
-			printf("ERR: needle already set\n");
+			lprintf(LOG_ERR, "ERR: needle already set\n");
+			return (-1);
 		} else if (!cur && !val) {
-			printf("ERR: needle already cleared\n");
+			lprintf(LOG_ERR, "ERR: needle already cleared\n");
+			return (-1);
 		} else {
 			pin_set(&gpio_sc, PORT_E, 0, val);
 			mdx_usleep(150000);
@@ -123,209 +491,2171 @@ gcode_command_actuate(struct gcode_command *cmd)
 			mdx_usleep(250000);
 		break;
 	default:
-		break;
+		lprintf(LOG_ERR, "ERR: nothing to actuate\n");
+		return (-1);
 	}
+
+	return (0);
 }
 
-static void
-gcode_command(char *line, int len)
+/*
+ * M111 S<level> [C<category>]: set the log level of a category, of all
+ * of them without C.  Just M111 reports the levels.
+ */
+static int
+gcode_command_log(struct gcode_command *cmd)
 {
-	struct gcode_command cmd;
-	uint8_t letter;
-	char *endp;
-	char *end;
-	float value;
+	int error;
+
+	if (cmd->log_level_set == 0) {
+		log_report();
+		return (0);
+	}
+
+	error = log_set_level(cmd->log_cat_set ? cmd->log_cat : -1,
+	    cmd->log_level);
+	if (error)
+		lprintf(LOG_ERR, "ERR: bad log level or category\n");
 
-#ifdef GCODE_DEBUG
+	return (error);
+}
+
+/* Append the decimal digits of v, returns their count. */
+static int
+gcode_put_num(char *buf, int64_t v)
+{
+	char tmp[20];
+	int len;
 	int i;
-	printf("GCODE: ");
+
+	len = 0;
+	do {
+		tmp[len++] = '0' + v % 10;
+		v /= 10;
+	} while (v > 0);
+
 	for (i = 0; i < len; i++)
-		printf("%c", line[i]);
-	printf("\n");
-#endif
+		buf[i] = tmp[len - 1 - i];
 
-	bzero(&cmd, sizeof(struct gcode_command));
+	return (len);
+}
+
+/* Append v, in millionths, to three decimals.  Returns the length. */
+static int
+gcode_put_fixed(char *buf, int64_t v)
+{
+	int len;
 
-	end = line + len;
-	while (line < end) {
-		letter = *line;
+	len = 0;
+	if (v < 0) {
+		buf[len++] = '-';
+		v = -v;
+	}
 
-		/* Skip spaces. */
-		if (letter == ' ') {
-			line += 1;
-			continue;
-		}
+	v = (v + 500) / 1000;
+	len += gcode_put_num(&buf[len], v / 1000);
+	buf[len++] = '.';
+	buf[len++] = '0' + v / 100 % 10;
+	buf[len++] = '0' + v / 10 % 10;
+	buf[len++] = '0' + v % 10;
 
-		if (letter < 'A' || letter > 'Z') {
-			printf("%s: Error: expected a letter.\n", __func__);
-			break;
-		}
+	return (len);
+}
 
-		/* Skip letter. */
-		line += 1;
+/* Reply with a value for each axis, in millionths. */
+static void
+gcode_report_axes(const int64_t *v)
+{
+	char buf[160];
+	int len;
+	int i;
 
-		/* Ensure we are dealing with digit, + or -. */
-		if ((*line < '0' || *line > '9') &&
-		    (*line != '+') &&
-		    (*line != '-'))
-			break;
+	len = 0;
+	for (i = 0; i < PNP_NAXES; i++) {
+		buf[len++] = ' ';
+		buf[len++] = gcode_axes[i];
+		buf[len++] = ':';
+		len += gcode_put_fixed(&buf[len], v[i]);
+	}
+	buf[len] = '\0';
 
-		value = strtof(line, &endp);
-		line = endp;
+	printf("ok%s\n", buf);
+}
 
-		printf("%s: value %.3f\n", __func__, value);
+/* The axis values of the command by axis, returns the mask of those set. */
+static int
+gcode_axis_args(struct gcode_command *cmd, int *v)
+{
+	int set;
 
-		switch (letter) {
-		case 'M':
-			if (value == 800.0f)
-				cmd.type = CMD_TYPE_ACTUATE;
-			else if (value == 105.0f)
-				cmd.type = CMD_TYPE_SENSOR_READ;
-			break;
-		case 'G':
-			if (value == 0.0f) /* Linear move. */
-				cmd.type = CMD_TYPE_MOVE;
-			break;
-		case 'X':
-			cmd.x = value * 1000000;
-			cmd.x_set = 1;
-			break;
-		case 'Y':
-			cmd.y = value * 1000000;
-			cmd.y_set = 1;
-			break;
-		case 'Z':
-			cmd.z = value * 1000000;
-			cmd.z_set = 1;
-			break;
-		case 'I':
-			cmd.h1 = value * 1000000;
-			cmd.h1_set = 1;
-			break;
-		case 'J':
-			cmd.h2 = value * 1000000;
-			cmd.h2_set = 1;
-			break;
-		case 'P':
-			cmd.actuate_target |= PNP_ACTUATE_TARGET_PUMP;
-			cmd.actuate_value = value;
-			break;
-		case 'V':
-			/* Air vacuum 1 */
-			cmd.actuate_target |= PNP_ACTUATE_TARGET_AVAC1;
-			cmd.actuate_value = value;
-			break;
-		case 'W':
-			/* Air vacuum 2 */
-			cmd.actuate_target |= PNP_ACTUATE_TARGET_AVAC2;
-			cmd.actuate_value = value;
-			break;
-		case 'N':
-			/* Air vac sensors read. */
-			cmd.sensor_read_target = value;
-			break;
-		case 'D':
-			/* Needle */
-			cmd.actuate_target |= PNP_ACTUATE_TARGET_NEEDLE;
-			cmd.actuate_value = value;
-			break;
-		case 'O':
-			/* Peel */
-			cmd.actuate_target |= PNP_ACTUATE_TARGET_PEEL;
-			cmd.actuate_value = value;
-			break;
-		case 'F':
-			break;
-		default:
-			break;
-		}
+	set = 0;
+	v[PNP_AXIS_X] = cmd->x;
+	if (cmd->x_set)
+		set |= (1 << PNP_AXIS_X);
+	v[PNP_AXIS_Y] = cmd->y;
+	if (cmd->y_set)
+		set |= (1 << PNP_AXIS_Y);
+	v[PNP_AXIS_Z] = cmd->z;
+	if (cmd->z_set)
+		set |= (1 << PNP_AXIS_Z);
+	v[PNP_AXIS_H1] = cmd->h1;
+	if (cmd->h1_set)
+		set |= (1 << PNP_AXIS_H1);
+	v[PNP_AXIS_H2] = cmd->h2;
+	if (cmd->h2_set)
+		set |= (1 << PNP_AXIS_H2);
+
+	return (set);
+}
+
+/* G4 P<ms> or S<s>: wait once the moves queued so far are done. */
+static int
+gcode_command_dwell(struct gcode_command *cmd)
+{
+	int64_t us;
+	uint32_t t;
+
+	pnp_sync();
+
+	if (cmd->p_set)
+		us = cmd->p / 1000;
+	else if (cmd->s_set)
+		us = cmd->s;
+	else
+		return (0);
+
+	/* In slices, so that Ctrl-X ends it. */
+	while (us > 0 && queue.flush == 0) {
+		t = us > GCODE_DWELL_SLICE ? GCODE_DWELL_SLICE : us;
+		mdx_usleep(t);
+		us -= t;
 	}
 
-	/* Acknowledge the command. */
-	printf("OK\n");
+	return (0);
+}
 
-	switch (cmd.type) {
-	case CMD_TYPE_MOVE:
-		pnp_command_move(&cmd);
-		break;
-	case CMD_TYPE_ACTUATE:
-		gcode_command_actuate(&cmd);
-		break;
-	case CMD_TYPE_SENSOR_READ:
-		gcode_command_sensor_read(&cmd);
-		break;
-	};
+/* G28: home, all of X, Y and Z whatever axes are given. */
+static int
+gcode_command_home(struct gcode_command *cmd)
+{
 
-	/* TODO: check for errors. */
-	printf("COMPLETE\n");
+	if (pnp_home() != 0) {
+		lprintf(LOG_ERR, "ERR: homing failed\n");
+		return (-1);
+	}
+
+	return (0);
 }
 
-static void
-gcode_process_data(int ptr, int len)
+/* G90, G91: absolute or relative positions from now on. */
+static int
+gcode_command_distance(struct gcode_command *cmd)
+{
+
+	pnp_set_relative(cmd->type == CMD_TYPE_RELATIVE);
+
+	return (0);
+}
+
+/* M114: where the moves queued so far have left the machine. */
+static int
+gcode_command_position(struct gcode_command *cmd)
 {
-	uint8_t *start;
-	uint8_t ch;
+	int64_t v[PNP_NAXES];
+	int pos[PNP_NAXES];
 	int i;
 
-	start = &dma_buffer[ptr];
-	for (i = 0; i < len; i++) {
-		ch = start[i];
-		dprintf("ch %d\n", ch);
-		cmd_buffer[cmd_buffer_ptr] = ch;
-		if (ch == '\n') { /* LF */
-			gcode_command(cmd_buffer, cmd_buffer_ptr);
-			cmd_buffer_ptr = 0;
-		} else
-			cmd_buffer_ptr += 1;
-	}
+	pnp_sync();
+	pnp_get_position(pos);
+
+	for (i = 0; i < PNP_NAXES; i++)
+		v[i] = pos[i];
+
+	gcode_report_axes(v);
+
+	return (0);
 }
 
-static void
-gcode_dmarecv_init(void)
+/* M115 */
+static int
+gcode_command_firmware(struct gcode_command *cmd)
 {
-	struct stm32f4_dma_conf conf;
 
-	bzero(&conf, sizeof(struct stm32f4_dma_conf));
-	conf.mem0 = (uintptr_t)dma_buffer;
-	conf.sid = 2;
-	conf.periph_addr = USART1_BASE + USART_DR;
-	conf.dir = 0;
-	conf.channel = 4;
-	conf.circ = 1;
-	conf.psize = 8;
-	conf.nbytes = DMA_BUF_SIZE;
+	printf("FIRMWARE_NAME:neodenyy1 MACHINE_TYPE:Neoden YY1 AXES:%d\n",
+	    PNP_NAXES);
+	printf("Cap:LINE_NUMBERS:1\n");
+	printf("Cap:BINARY_FRAMES:1\n");
+	printf("Cap:REALTIME:1\n");
+	printf("Cap:SENSOR_EVENTS:1\n");
+	printf("Cap:MACROS:%d\n", GCODE_MACROS);
+	printf("Cap:AUTOREPORT_POS:1\n");
+	printf("Cap:QUEUE_DEPTH:%d\n", GCODE_QUEUE_DEPTH);
 
-	stm32f4_dma_setup(&dma2_sc, &conf);
-	stm32f4_dma_control(&dma2_sc, 2, 1);
+	return (0);
 }
 
-int
-gcode_mainloop(void)
+/*
+ * M92 [X..] [Y..] [Z..] [I..] [J..]: steps per unit, M203: top speeds,
+ * units/s.  Units are mm for X and Y and degrees for Z, the cam angle,
+ * and the heads.  Without axes the values are reported.
+ */
+static int
+gcode_command_limits(struct gcode_command *cmd)
 {
-	uint32_t cnt;
-	int ptr;
+	float accel;
+	float steps;
+	float vel;
+	int64_t v[PNP_NAXES];
+	int arg[PNP_NAXES];
+	float f;
+	int error;
+	int ret;
+	int set;
+	int i;
+
+	error = 0;
+	set = gcode_axis_args(cmd, arg);
+	for (i = 0; i < PNP_NAXES; i++) {
+		if ((set & (1 << i)) == 0)
+			continue;
+		f = (float)arg[i] / GCODE_FIXED_ONE;
+		if (cmd->type == CMD_TYPE_STEPS)
+			ret = pnp_set_steps_per_unit(i, f);
+		else
+			ret = pnp_set_max_vel(i, f);
+		if (ret != 0) {
+			lprintf(LOG_ERR, "ERR: bad value for %c\n",
+			    gcode_axes[i]);
+			error = -1;
+		}
+	}
 
-	ptr = 0;
-	cmd_buffer_ptr = 0;
+	if (set != 0)
+		return (error);
 
-	gcode_dmarecv_init();
+	for (i = 0; i < PNP_NAXES; i++) {
+		pnp_get_limits(i, &steps, &vel, &accel);
+		f = cmd->type == CMD_TYPE_STEPS ? steps : vel;
+		v[i] = (int64_t)(f * GCODE_FIXED_ONE);
+	}
 
-	/* Periodically poll for a new data. */
-	while (1) {
-		cnt = stm32f4_dma_getcnt(&dma2_sc, 2);
-		cnt = DMA_BUF_SIZE - cnt;
+	gcode_report_axes(v);
+
+	return (0);
+}
+
+/*
+ * M204 S<mm/s^2>: acceleration of X and Y, P is taken the same.  Z and
+ * the heads keep theirs.  Without S the value is reported.
+ */
+static int
+gcode_command_accel(struct gcode_command *cmd)
+{
+	float accel;
+	float steps;
+	float vel;
+	char buf[32];
+	int64_t v;
+	int len;
+
+	if (cmd->s_set || cmd->p_set) {
+		v = cmd->s_set ? cmd->s : cmd->p;
+		accel = (float)v / GCODE_FIXED_ONE;
+		if (pnp_set_max_accel(PNP_AXIS_X, accel) != 0 ||
+		    pnp_set_max_accel(PNP_AXIS_Y, accel) != 0) {
+			lprintf(LOG_ERR, "ERR: bad acceleration\n");
+			return (-1);
+		}
+		return (0);
+	}
+
+	pnp_get_limits(PNP_AXIS_X, &steps, &vel, &accel);
+	len = gcode_put_fixed(buf, (int64_t)(accel * GCODE_FIXED_ONE));
+	buf[len] = '\0';
 
-		if (cnt > ptr) {
-			gcode_process_data(ptr, (cnt - ptr));
-			ptr = cnt;
-		} else if (cnt < ptr) {
-			/* Buffer wrapped. */
-			gcode_process_data(ptr, DMA_BUF_SIZE - ptr);
-			gcode_process_data(0, cnt);
-			ptr = cnt;
+	printf("ok S:%s\n", buf);
+
+	return (0);
+}
+
+/*
+ * M205 J<mm>: junction deviation of the planner, J0 stops at every
+ * corner.  Without J the value is reported.
+ */
+static int
+gcode_command_junction(struct gcode_command *cmd)
+{
+	char buf[32];
+	int len;
+
+	/* J is the H2 axis letter. */
+	if (cmd->h2_set) {
+		if (pnp_set_junction_deviation((float)cmd->h2 /
+		    GCODE_FIXED_ONE) != 0) {
+			lprintf(LOG_ERR, "ERR: bad junction deviation\n");
+			return (-1);
 		}
+		return (0);
+	}
+
+	len = gcode_put_fixed(buf,
+	    (int64_t)(pnp_get_junction_deviation() * GCODE_FIXED_ONE));
+	buf[len] = '\0';
+
+	printf("ok J:%s\n", buf);
+
+	return (0);
+}
+
+/*
+ * M804 [S0|S1] [Z<mm>]: blended Z and X/Y moves off or on, and the Z the
+ * nozzles are clear within.  S0 makes every move wait for the one before
+ * to be over.  Without either the settings are reported.
+ */
+static int
+gcode_command_blend(struct gcode_command *cmd)
+{
+	char buf[32];
+	int enable;
+	int safe_z;
+	int len;
+
+	pnp_get_blend(&enable, &safe_z);
+
+	if (cmd->s_set || cmd->z_set) {
+		if (cmd->s_set)
+			enable = cmd->s != 0;
+		if (cmd->z_set)
+			safe_z = cmd->z;
+		if (pnp_set_blend(enable, safe_z) != 0) {
+			lprintf(LOG_ERR, "ERR: bad safe Z\n");
+			return (-1);
+		}
+		return (0);
+	}
+
+	len = gcode_put_fixed(buf, safe_z);
+	buf[len] = '\0';
+
+	printf("ok S:%d Z:%s\n", enable, buf);
+
+	return (0);
+}
+
+/* X and Y given, bare or with a value, as a mask.  Both if neither is. */
+static int
+gcode_xy_axes(struct gcode_command *cmd)
+{
+	int axes;
+
+	axes = 0;
+	if (cmd->x_set || (cmd->params & CMD_PARAM_X))
+		axes |= (1 << PNP_AXIS_X);
+	if (cmd->y_set || (cmd->params & CMD_PARAM_Y))
+		axes |= (1 << PNP_AXIS_Y);
+	if (axes == 0)
+		axes = (1 << PNP_AXIS_X) | (1 << PNP_AXIS_Y);
+
+	return (axes);
+}
+
+/*
+ * M593 [X] [Y] [T<type>] [F<Hz>] [D<ratio>]: input shaper of X, Y or
+ * both.  T0 is none, T1 ZV, T2 ZVD and T3 EI.  What is not given stays,
+ * but F alone turns on ZV on an axis without a shaper.  Without T, F
+ * and D the shapers are reported.
+ */
+static int
+gcode_command_shaper(struct gcode_command *cmd)
+{
+	char f[32];
+	char d[32];
+	float damping;
+	float freq;
+	int error;
+	int axis;
+	int axes;
+	int type;
+	int len;
+
+	error = 0;
+	axes = gcode_xy_axes(cmd);
+
+	for (axis = PNP_AXIS_X; axis <= PNP_AXIS_Y; axis++) {
+		if ((axes & (1 << axis)) == 0)
+			continue;
+
+		pnp_get_shaper(axis, &type, &freq, &damping);
+
+		if (cmd->t_set == 0 && cmd->feed_set == 0 &&
+		    cmd->d_set == 0) {
+			len = gcode_put_fixed(f,
+			    (int64_t)(freq * GCODE_FIXED_ONE));
+			f[len] = '\0';
+			len = gcode_put_fixed(d,
+			    (int64_t)(damping * GCODE_FIXED_ONE));
+			d[len] = '\0';
+			printf("ok %c T:%d F:%s D:%s\n", gcode_axes[axis],
+			    type, f, d);
+			continue;
+		}
+
+		if (cmd->t_set)
+			type = cmd->t;
+		else if (type == SHAPER_NONE && cmd->feed_set)
+			type = SHAPER_ZV;
+		if (cmd->feed_set)
+			freq = cmd->feed;
+		if (cmd->d_set)
+			damping = (float)cmd->d / GCODE_FIXED_ONE;
+
+		if (pnp_set_shaper(axis, type, freq, damping) != 0) {
+			lprintf(LOG_ERR, "ERR: bad shaper for %c\n",
+			    gcode_axes[axis]);
+			error = -1;
+		}
+	}
+
+	return (error);
+}
+
+/*
+ * M958 [X] [Y]: resonance test of X, Y or both in turn, see
+ * pnp_test_resonance().  It takes some seconds per axis.
+ */
+static int
+gcode_command_resonance(struct gcode_command *cmd)
+{
+	int error;
+	int axis;
+	int axes;
+
+	error = 0;
+	axes = gcode_xy_axes(cmd);
+
+	for (axis = PNP_AXIS_X; axis <= PNP_AXIS_Y; axis++) {
+		if ((axes & (1 << axis)) == 0)
+			continue;
+		if (pnp_test_resonance(axis) != 0) {
+			lprintf(LOG_ERR, "ERR: can't test %c\n",
+			    gcode_axes[axis]);
+			error = -1;
+		}
+	}
+
+	return (error);
+}
+
+/*
+ * M805 [I0|I1] [J0|J1]: whether a nozzle angle is taken modulo a turn
+ * and reached the shortest way, or kept within +-180 degrees.  Off for
+ * both nozzles at power up.  Without axes the modes are reported.
+ */
+static int
+gcode_command_modular(struct gcode_command *cmd)
+{
+	int arg[PNP_NAXES];
+	int error;
+	int set;
+	int i;
+
+	error = 0;
+	set = gcode_axis_args(cmd, arg);
+	for (i = 0; i < PNP_NAXES; i++) {
+		if ((set & (1 << i)) == 0)
+			continue;
+		if (pnp_set_modular(i, arg[i] != 0) != 0) {
+			lprintf(LOG_ERR, "ERR: %c can't turn round\n",
+			    gcode_axes[i]);
+			error = -1;
+		}
+	}
+
+	if (set != 0)
+		return (error);
+
+	printf("ok I:%d J:%d\n", pnp_get_modular(PNP_AXIS_H1),
+	    pnp_get_modular(PNP_AXIS_H2));
+
+	return (0);
+}
+
+/*
+ * Wait for room in the queue and hand the command to the executor.  With
+ * ack it is acknowledged once there is room, and before the executor can
+ * get to it, so that the OK always comes ahead of its COMPLETE.
+ */
+static void
+gcode_enqueue(struct gcode_command *cmd, int ack)
+{
+
+	mdx_sem_wait(&queue.free_sem);
+	if (ack)
+		gcode_ack(cmd);
+	queue.cmds[queue.head] = *cmd;
+	queue.head = (queue.head + 1) % GCODE_QUEUE_DEPTH;
+	mdx_sem_post(&queue.used_sem);
+}
+
+static inline int
+gcode_span_len(struct gcode_span *sp)
+{
+
+	return (sp->len[0] + sp->len[1]);
+}
+
+/* Character at pos of the line, 0 past its end. */
+static inline int
+gcode_span_char(struct gcode_span *sp, int pos)
+{
+
+	if (pos < sp->len[0])
+		return (sp->buf[0][pos]);
+	pos -= sp->len[0];
+	if (pos < sp->len[1])
+		return (sp->buf[1][pos]);
+
+	return (0);
+}
+
+/*
+ * Parse the decimal number at *pos of the line into millionths.  No
+ * float is involved, so every digit up to the sixth after the point
+ * counts.  Returns -1 for a malformed or out of range number.
+ */
+static int
+gcode_span_fixed(struct gcode_span *sp, int *pos, int64_t *value)
+{
+	int64_t v;
+	int digits;
+	int scale;
+	int neg;
+	int c;
+	int n;
+	int p;
+
+	p = *pos;
+	neg = 0;
+
+	c = gcode_span_char(sp, p);
+	if (c == '-' || c == '+') {
+		neg = (c == '-');
+		c = gcode_span_char(sp, ++p);
+	}
+
+	v = 0;
+	digits = 0;
+	while (c >= '0' && c <= '9') {
+		v = v * 10 + (c - '0');
+		if (v > GCODE_FIXED_MAX / GCODE_FIXED_ONE)
+			return (-1);
+		digits += 1;
+		c = gcode_span_char(sp, ++p);
+	}
+	v *= GCODE_FIXED_ONE;
+
+	if (c == '.') {
+		c = gcode_span_char(sp, ++p);
+		scale = GCODE_FIXED_ONE;
+		n = 0;
+		while (c >= '0' && c <= '9') {
+			if (n < GCODE_FIXED_DIGITS) {
+				scale /= 10;
+				v += (c - '0') * scale;
+			} else if (n == GCODE_FIXED_DIGITS && c >= '5')
+				v += 1;		/* Round the rest off. */
+			n += 1;
+			c = gcode_span_char(sp, ++p);
+		}
+		digits += n;
+	}
+
+	/* Something like "-", "." or "1.2.3". */
+	if (digits == 0 || c == '.' || c == '+' || c == '-')
+		return (-1);
+
+	if (v > GCODE_FIXED_MAX)
+		return (-1);
+
+	*value = neg ? -v : v;
+	*pos = p;
+
+	return (0);
+}
+
+/*
+ * Offset of the first LF in dma_buffer[from..to), or to.  Goes a word at
+ * a time: a byte of w ^ LF is zero for every LF in w.
+ */
+static int
+gcode_find_eol(int from, int to)
+{
+	uint32_t w;
+
+	while (from < to && (from & 3) != 0) {
+		if (dma_buffer[from] == '\n')
+			return (from);
+		from += 1;
+	}
+
+	while (from + 4 <= to) {
+		w = *(const uint32_t *)&dma_buffer[from] ^ 0x0a0a0a0a;
+		if (((w - 0x01010101) & ~w & 0x80808080) != 0)
+			break;
+		from += 4;
+	}
+
+	while (from < to) {
+		if (dma_buffer[from] == '\n')
+			return (from);
+		from += 1;
+	}
+
+	return (to);
+}
+
+/* Drop whatever has been received so far. */
+static void
+gcode_rx_skip(void)
+{
+
+	critical_enter();
+	rx.ready = rx.line = rx.scan = gcode_rx_cnt();
+	critical_exit();
+	rx.discard = 0;
+}
+
+/* Whether the line from rx.line up to the LF at eol ends in str. */
+static int
+gcode_rx_ends(int eol, const char *str)
+{
+	int len;
+	int n;
+	int i;
+
+	len = (eol - rx.line + DMA_BUF_SIZE) % DMA_BUF_SIZE;
+	if (len > 0 && dma_buffer[(eol - 1 + DMA_BUF_SIZE) % DMA_BUF_SIZE] ==
+	    '\r')
+		len -= 1;
+
+	n = strlen(str);
+	if (len < n)
+		return (0);
+
+	for (i = 0; i < n; i++)
+		if (dma_buffer[(rx.line + len - n + i) % DMA_BUF_SIZE] !=
+		    str[i])
+			return (0);
+
+	return (1);
+}
+
+/*
+ * Wait for the host to confirm the new rate.  Bytes that came in around
+ * the switch are garbage, only the end of the line counts.
+ */
+static int
+gcode_baud_confirm(void)
+{
+	int found;
+	int end;
+	int eol;
+	int cnt;
+	int i;
+
+	for (i = 0; i < GCODE_BAUD_WAIT / GCODE_BAUD_POLL; i++) {
+		mdx_usleep(GCODE_BAUD_POLL);
+
+		cnt = rx.ready;
+		while (rx.scan != cnt) {
+			end = cnt > rx.scan ? cnt : DMA_BUF_SIZE;
+			eol = gcode_find_eol(rx.scan, end);
+			if (eol == end) {
+				rx.scan = end % DMA_BUF_SIZE;
+				continue;
+			}
+			found = gcode_rx_ends(eol, "M575");
+			rx.scan = (eol + 1) % DMA_BUF_SIZE;
+			rx.line = rx.scan;
+			if (found)
+				return (1);
+		}
+	}
+
+	return (0);
+}
+
+/* Wait until everything queued so far is done. */
+static void
+gcode_drain(void)
+{
+	struct gcode_command wait;
+
+	bzero(&wait, sizeof(struct gcode_command));
+	wait.type = CMD_TYPE_WAIT;
+	gcode_enqueue(&wait, 0);
+	mdx_sem_wait(&queue.drain_sem);
+}
+
+/*
+ * M575 B<rate>: acknowledge at the current rate, switch and wait for the
+ * host to confirm at the new one, or go back.  COMPLETE comes at the new
+ * rate, ERROR at the old one.  A confirmed rate is saved and used from
+ * the next power up.  Without B the rate is reported.
+ */
+static int
+gcode_baud(struct gcode_command *cmd)
+{
+	struct settings *settings;
+	uint32_t old;
+
+	old = board_get_baud();
+
+	if (cmd->baud_set == 0) {
+		printf("ok B:%u\n", (unsigned)old);
+		return (GCODE_DONE);
+	}
+
+	if (!board_baud_valid(cmd->baud)) {
+		lprintf(LOG_ERR, "ERR: %d baud is not possible\n", cmd->baud);
+		return (-1);
+	}
+
+	/* Nothing may be printed across the switch. */
+	gcode_drain();
+
+	gcode_ack(cmd);
+
+	board_set_baud(cmd->baud);
+	gcode_rx_skip();
+
+	if (gcode_baud_confirm() == 0) {
+		board_set_baud(old);
+		gcode_rx_skip();
+		lprintf(LOG_ERR, "ERR: %d baud not confirmed\n", cmd->baud);
+		return (-1);
+	}
+
+	settings = settings_get();
+	if (settings->baud != cmd->baud) {
+		settings->baud = cmd->baud;
+		if (settings_save() != 0) {
+			lprintf(LOG_ERR, "ERR: can't save the rate\n");
+			return (-1);
+		}
+	}
+
+	return (GCODE_DONE);
+}
+
+/*
+ * G and M codes by number.  The letters after the code go into the same
+ * struct gcode_command whatever it is, each handler takes the ones it
+ * needs.
+ */
+struct gcode_code {
+	uint8_t letter;
+	int number;
+	int type;
+};
+
+static const struct gcode_code gcode_codes[] = {
+	{ 'G', 0, CMD_TYPE_MOVE },
+	{ 'G', 1, CMD_TYPE_MOVE },
+	{ 'G', 4, CMD_TYPE_DWELL },
+	{ 'G', 28, CMD_TYPE_HOME },
+	{ 'G', 90, CMD_TYPE_ABSOLUTE },
+	{ 'G', 91, CMD_TYPE_RELATIVE },
+	{ 'M', 92, CMD_TYPE_STEPS },
+	{ 'M', 105, CMD_TYPE_SENSOR_READ },
+	{ 'M', 111, CMD_TYPE_LOG },
+	{ 'M', 114, CMD_TYPE_POSITION },
+	{ 'M', 115, CMD_TYPE_FIRMWARE },
+	{ 'M', 154, CMD_TYPE_REPORT },
+	{ 'M', 203, CMD_TYPE_MAX_FEED },
+	{ 'M', 204, CMD_TYPE_ACCEL },
+	{ 'M', 205, CMD_TYPE_JUNCTION },
+	{ 'M', 400, CMD_TYPE_WAIT },
+	{ 'M', 575, CMD_TYPE_BAUD },
+	{ 'M', 593, CMD_TYPE_SHAPER },
+	{ 'M', 800, CMD_TYPE_ACTUATE },
+	{ 'M', 801, CMD_TYPE_BINARY },
+	{ 'M', 802, CMD_TYPE_EVENTS },
+	{ 'M', 803, CMD_TYPE_NO_EVENTS },
+	{ 'M', 804, CMD_TYPE_BLEND },
+	{ 'M', 805, CMD_TYPE_MODULAR },
+	{ 'M', 821, CMD_TYPE_MACRO },
+	{ 'M', 822, CMD_TYPE_MACRO_SAVE },
+	{ 'M', 958, CMD_TYPE_RESONANCE },
+};
+
+/* The command type of a code, 0 if there is no such code. */
+static int
+gcode_code_type(uint8_t letter, int64_t value)
+{
+	const struct gcode_code *code;
+	int number;
+	int i;
+
+	if (value < 0 || value % GCODE_FIXED_ONE != 0)
+		return (0);
+	number = value / GCODE_FIXED_ONE;
+
+	for (i = 0; i < sizeof(gcode_codes) / sizeof(gcode_codes[0]); i++) {
+		code = &gcode_codes[i];
+		if (code->letter == letter && code->number == number)
+			return (code->type);
+	}
+
+	return (0);
+}
+
+/*
+ * Parse the line into cmd.  Returns -1 if the line is malformed.
+ */
+static int
+gcode_parse(struct gcode_span *sp, struct gcode_command *cmd)
+{
+	uint8_t letter;
+	int64_t value;
+	int pos;
+	int len;
+
+	bzero(cmd, sizeof(struct gcode_command));
+
+	len = gcode_span_len(sp);
+	pos = 0;
+	while (pos < len) {
+		letter = gcode_span_char(sp, pos);
+
+		/* Skip spaces. */
+		if (letter == ' ') {
+			pos += 1;
+			continue;
+		}
+
+		/* The rest is a comment. */
+		if (letter == ';')
+			break;
+
+		if (letter < 'A' || letter > 'Z') {
+			lprintf(LOG_ERR, "%s: Error: expected a letter.\n",
+			    __func__);
+			return (-1);
+		}
+
+		/* Skip letter. */
+		pos += 1;
+
+		/* An axis without a value, filled in by M821. */
+		if (gcode_span_char(sp, pos) == ' ' ||
+		    gcode_span_char(sp, pos) == ';' ||
+		    gcode_span_char(sp, pos) == 0) {
+			switch (letter) {
+			case 'X':
+				cmd->params |= CMD_PARAM_X;
+				continue;
+			case 'Y':
+				cmd->params |= CMD_PARAM_Y;
+				continue;
+			case 'Z':
+				cmd->params |= CMD_PARAM_Z;
+				continue;
+			case 'I':
+				cmd->params |= CMD_PARAM_H1;
+				continue;
+			case 'J':
+				cmd->params |= CMD_PARAM_H2;
+				continue;
+			default:
+				break;
+			}
+		}
+
+		if (gcode_span_fixed(sp, &pos, &value) != 0) {
+			lprintf(LOG_ERR, "%s: Error: bad number for %c.\n",
+			    __func__, letter);
+			return (-1);
+		}
+
+		if (letter != 'F' && letter != 'B' && letter != 'P' &&
+		    letter != 'S' && letter != 'D' &&
+		    (value > GCODE_POS_MAX || value < -GCODE_POS_MAX)) {
+			lprintf(LOG_ERR, "%s: Error: %c is out of range.\n",
+			    __func__, letter);
+			return (-1);
+		}
+
+		lprintf(LOG_DEBUG, "%s: %c %s%d.%06d\n", __func__, letter,
+		    value < 0 ? "-" : "",
+		    (int)((value < 0 ? -value : value) / GCODE_FIXED_ONE),
+		    (int)((value < 0 ? -value : value) % GCODE_FIXED_ONE));
+
+		switch (letter) {
+		case 'G':
+		case 'M':
+			cmd->type = gcode_code_type(letter, value);
+			if (cmd->type == 0) {
+				lprintf(LOG_ERR, "%s: Error: unknown code.\n",
+				    __func__);
+				return (-1);
+			}
+			break;
+		case 'X':
+			cmd->x = value;
+			cmd->x_set = 1;
+			break;
+		case 'Y':
+			cmd->y = value;
+			cmd->y_set = 1;
+			break;
+		case 'Z':
+			cmd->z = value;
+			cmd->z_set = 1;
+			break;
+		case 'I':
+			cmd->h1 = value;
+			cmd->h1_set = 1;
+			break;
+		case 'J':
+			cmd->h2 = value;
+			cmd->h2_set = 1;
+			break;
+		case 'P':
+			cmd->actuate_target |= PNP_ACTUATE_TARGET_PUMP;
+			cmd->actuate_value = value / GCODE_FIXED_ONE;
+			cmd->p = value;
+			cmd->p_set = 1;
+			break;
+		case 'V':
+			/* Air vacuum 1 */
+			cmd->actuate_target |= PNP_ACTUATE_TARGET_AVAC1;
+			cmd->actuate_value = value / GCODE_FIXED_ONE;
+			break;
+		case 'W':
+			/* Air vacuum 2 */
+			cmd->actuate_target |= PNP_ACTUATE_TARGET_AVAC2;
+			cmd->actuate_value = value / GCODE_FIXED_ONE;
+			break;
+		case 'N':
+			/* Air vac sensors read. */
+			cmd->sensor_read_target = value / GCODE_FIXED_ONE;
+			break;
+		case 'D':
+			/* Needle */
+			cmd->actuate_target |= PNP_ACTUATE_TARGET_NEEDLE;
+			cmd->actuate_value = value / GCODE_FIXED_ONE;
+			cmd->d = value;
+			cmd->d_set = 1;
+			break;
+		case 'O':
+			/* Peel */
+			cmd->actuate_target |= PNP_ACTUATE_TARGET_PEEL;
+			cmd->actuate_value = value / GCODE_FIXED_ONE;
+			break;
+		case 'S':
+			cmd->log_level = value / GCODE_FIXED_ONE;
+			cmd->log_level_set = 1;
+			cmd->s = value;
+			cmd->s_set = 1;
+			break;
+		case 'C':
+			cmd->log_cat = value / GCODE_FIXED_ONE;
+			cmd->log_cat_set = 1;
+			break;
+		case 'B':
+			cmd->baud = value / GCODE_FIXED_ONE;
+			cmd->baud_set = 1;
+			break;
+		case 'Q':
+			cmd->macro = value / GCODE_FIXED_ONE;
+			break;
+		case 'T':
+			cmd->t = value / GCODE_FIXED_ONE;
+			cmd->t_set = 1;
+			break;
+		case 'F':
+			/* Feed rate, mm/min. */
+			cmd->feed = (float)value / GCODE_FIXED_ONE;
+			cmd->feed_set = 1;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return (0);
+}
+
+/* Take the axis from the M821 line if the macro line asks for it. */
+static void
+gcode_macro_arg(int params, int param, int *dst, int *dst_set, int val,
+    int val_set)
+{
+
+	if ((params & param) && val_set) {
+		*dst = val;
+		*dst_set = 1;
+	}
+}
+
+/*
+ * M821 Q<n> [X..] [Y..] [Z..] [I..] [J..]: queue the lines of macro n
+ * back to back, then its end.  Only the end reports, COMPLETE or ERROR
+ * if any of the lines failed.
+ */
+static int
+gcode_macro_call(struct gcode_command *cmd)
+{
+	struct gcode_command step;
+	struct gcode_macro *m;
+	int i;
+
+	if (cmd->macro < 0 || cmd->macro >= GCODE_MACROS ||
+	    macros[cmd->macro].nsteps == 0) {
+		lprintf(LOG_ERR, "ERR: no macro %d\n", cmd->macro);
+		return (-1);
+	}
+
+	m = &macros[cmd->macro];
+	for (i = 0; i < m->nsteps; i++) {
+		step = m->steps[i];
+		gcode_macro_arg(step.params, CMD_PARAM_X, &step.x,
+		    &step.x_set, cmd->x, cmd->x_set);
+		gcode_macro_arg(step.params, CMD_PARAM_Y, &step.y,
+		    &step.y_set, cmd->y, cmd->y_set);
+		gcode_macro_arg(step.params, CMD_PARAM_Z, &step.z,
+		    &step.z_set, cmd->z, cmd->z_set);
+		gcode_macro_arg(step.params, CMD_PARAM_H1, &step.h1,
+		    &step.h1_set, cmd->h1, cmd->h1_set);
+		gcode_macro_arg(step.params, CMD_PARAM_H2, &step.h2,
+		    &step.h2_set, cmd->h2, cmd->h2_set);
+		step.macro_step = 1;
+		gcode_enqueue(&step, 0);
+	}
+
+	gcode_enqueue(cmd, 1);
+
+	return (GCODE_QUEUED);
+}
+
+/*
+ * M801: frames follow the acknowledge.  Binary mode is on before it goes
+ * out, so that the receive interrupt leaves the first frame alone.
+ */
+static int
+gcode_command_binary(struct gcode_command *cmd)
+{
+
+	rx.last_seq = -1;
+	rx.binary = 1;
+
+	return (GCODE_DONE);
+}
+
+/* M802, M803: sensor events on or off, after the OK. */
+static int
+gcode_command_events(struct gcode_command *cmd)
+{
+
+	gcode_ack(cmd);
+	sensor_subscribe(cmd->type == CMD_TYPE_EVENTS);
+
+	return (GCODE_DONE);
+}
+
+/*
+ * M154 S<s>: send the status report every S seconds by itself, S0 to
+ * stop.  Without S the period is reported.
+ */
+static int
+gcode_command_report(struct gcode_command *cmd)
+{
+	char buf[32];
+	int len;
+
+	if (cmd->s_set == 0) {
+		len = gcode_put_fixed(buf, report_us);
+		buf[len] = '\0';
+		printf("ok S:%s\n", buf);
+		return (GCODE_DONE);
+	}
+
+	if (cmd->s != 0 &&
+	    (cmd->s < GCODE_REPORT_MIN || cmd->s > GCODE_REPORT_MAX)) {
+		lprintf(LOG_ERR, "ERR: report period is out of range\n");
+		return (-1);
+	}
+
+	report_us = cmd->s;
+	gcode_ack(cmd);
+
+	/* The first one right away. */
+	mdx_sem_post(&status_sem);
+
+	return (GCODE_DONE);
+}
+
+/* M822 */
+static int
+gcode_command_macro_save(struct gcode_command *cmd)
+{
+
+	/* Erasing the sector stalls the CPU, wait for the moves. */
+	gcode_drain();
+	if (settings_save() != 0) {
+		lprintf(LOG_ERR, "ERR: can't save the macros\n");
+		return (-1);
+	}
+
+	return (GCODE_DONE);
+}
+
+/*
+ * What a command does: now, in place of queueing it, or when its turn
+ * in the queue comes.  M400 is done in both, see gcode_command().  Now
+ * returns GCODE_DONE, GCODE_QUEUED or -1 on an error, exec 0 or -1.
+ */
+struct gcode_handler {
+	int (*now)(struct gcode_command *cmd);
+	int (*exec)(struct gcode_command *cmd);
+};
+
+static const struct gcode_handler gcode_handlers[CMD_TYPES] = {
+	[CMD_TYPE_MOVE] = { NULL, pnp_command_move },
+	[CMD_TYPE_ACTUATE] = { NULL, gcode_command_actuate },
+	[CMD_TYPE_SENSOR_READ] = { NULL, gcode_command_sensor_read },
+	[CMD_TYPE_LOG] = { NULL, gcode_command_log },
+	[CMD_TYPE_BAUD] = { gcode_baud, NULL },
+	[CMD_TYPE_BINARY] = { gcode_command_binary, NULL },
+	[CMD_TYPE_EVENTS] = { gcode_command_events, NULL },
+	[CMD_TYPE_NO_EVENTS] = { gcode_command_events, NULL },
+	[CMD_TYPE_MACRO] = { gcode_macro_call, NULL },
+	[CMD_TYPE_MACRO_SAVE] = { gcode_command_macro_save, NULL },
+	[CMD_TYPE_DWELL] = { NULL, gcode_command_dwell },
+	[CMD_TYPE_HOME] = { NULL, gcode_command_home },
+	[CMD_TYPE_ABSOLUTE] = { NULL, gcode_command_distance },
+	[CMD_TYPE_RELATIVE] = { NULL, gcode_command_distance },
+	[CMD_TYPE_STEPS] = { NULL, gcode_command_limits },
+	[CMD_TYPE_POSITION] = { NULL, gcode_command_position },
+	[CMD_TYPE_FIRMWARE] = { NULL, gcode_command_firmware },
+	[CMD_TYPE_MAX_FEED] = { NULL, gcode_command_limits },
+	[CMD_TYPE_ACCEL] = { NULL, gcode_command_accel },
+	[CMD_TYPE_REPORT] = { gcode_command_report, NULL },
+	[CMD_TYPE_JUNCTION] = { NULL, gcode_command_junction },
+	[CMD_TYPE_BLEND] = { NULL, gcode_command_blend },
+	[CMD_TYPE_SHAPER] = { NULL, gcode_command_shaper },
+	[CMD_TYPE_RESONANCE] = { NULL, gcode_command_resonance },
+	[CMD_TYPE_MODULAR] = { NULL, gcode_command_modular },
+};
+
+static void
+gcode_execute(struct gcode_command *cmd)
+{
+	int error;
+
+	if (cmd->type == CMD_TYPE_WAIT) {
+		error = pnp_sync();
+		if (cmd->macro_step) {
+			if (error)
+				queue.macro_error = 1;
+			return;
+		}
+		/* Completed by the parser, once it knows. */
+		mdx_sem_post(&queue.drain_sem);
+		return;
+	}
+
+	error = 0;
+	if (gcode_handlers[cmd->type].exec != NULL)
+		error = gcode_handlers[cmd->type].exec(cmd);
+
+	/* A macro reports once, at its end. */
+	if (cmd->macro_step) {
+		if (error)
+			queue.macro_error = 1;
+		return;
+	}
+	if (cmd->type == CMD_TYPE_MACRO) {
+		if (queue.macro_error)
+			error = -1;
+		queue.macro_error = 0;
+	}
+
+	gcode_reply(cmd, error);
+}
+
+static void
+gcode_exec_thread(void *arg)
+{
+	struct gcode_command *cmd;
+
+	while (1) {
+		mdx_sem_wait(&queue.used_sem);
+		cmd = &queue.cmds[queue.tail];
+		if (queue.flush == 0 || cmd->type == CMD_TYPE_WAIT)
+			gcode_execute(cmd);
+		queue.tail = (queue.tail + 1) % GCODE_QUEUE_DEPTH;
+		mdx_sem_post(&queue.free_sem);
+	}
+}
+
+/*
+ * The command of the line, parsed and queued, or done right away.
+ * Returns -1 if the line is malformed or the command was refused, the
+ * caller replies ERROR then.
+ */
+static int
+gcode_command(struct gcode_span *sp)
+{
+	char line[MAX_GCODE_LEN + 1];
+	struct gcode_command cmd;
+	int pos;
+	int ret;
+
+	if (log_enabled(LOG_GCODE, LOG_DEBUG)) {
+		for (pos = 0; pos < gcode_span_len(sp); pos++)
+			line[pos] = gcode_span_char(sp, pos);
+		line[pos] = '\0';
+		lprintf(LOG_DEBUG, "GCODE: %s\n", line);
+	}
+
+	if (gcode_parse(sp, &cmd) != 0)
+		return (-1);
+
+	/* G28 X Y is homing X and Y, M593 X sets the shaper of X. */
+	if (cmd.params != 0 && cmd.type != CMD_TYPE_HOME &&
+	    cmd.type != CMD_TYPE_SHAPER && cmd.type != CMD_TYPE_RESONANCE) {
+		lprintf(LOG_ERR, "%s: Error: axis without a value.\n",
+		    __func__);
+		return (-1);
+	}
+
+	if (gcode_handlers[cmd.type].now != NULL) {
+		ret = gcode_handlers[cmd.type].now(&cmd);
+		if (ret == GCODE_DONE)
+			gcode_reply(&cmd, 0);
+		return (ret < 0 ? -1 : 0);
+	}
+
+	/* M400 is only acknowledged once everything before it is done. */
+	if (cmd.type == CMD_TYPE_WAIT) {
+		gcode_enqueue(&cmd, 0);
+		mdx_sem_wait(&queue.drain_sem);
+		gcode_reply(&cmd, 0);
+		return (0);
+	}
+
+	gcode_enqueue(&cmd, 1);
+
+	return (0);
+}
+
+/* Keep only the characters from..to of the line. */
+static void
+gcode_span_cut(struct gcode_span *sp, int from, int to)
+{
+
+	if (to <= sp->len[0]) {
+		sp->len[0] = to;
+		sp->len[1] = 0;
+	} else
+		sp->len[1] = to - sp->len[0];
+
+	if (from < sp->len[0]) {
+		sp->buf[0] += from;
+		sp->len[0] -= from;
+	} else {
+		from -= sp->len[0];
+		sp->buf[0] = sp->buf[1] + from;
+		sp->len[0] = sp->len[1] - from;
+		sp->len[1] = 0;
+	}
+}
+
+/* A whole number at pos, as far as the line goes. */
+static int
+gcode_span_int(struct gcode_span *sp, int *pos, int *value)
+{
+	int64_t v;
+
+	if (gcode_span_fixed(sp, pos, &v) != 0 || v % GCODE_FIXED_ONE != 0 ||
+	    v > GCODE_POS_MAX * GCODE_FIXED_ONE ||
+	    v < -GCODE_POS_MAX * GCODE_FIXED_ONE)
+		return (-1);
+
+	*value = v / GCODE_FIXED_ONE;
+
+	return (0);
+}
+
+/* Whether the line is the command word and its arguments, after pos. */
+static int
+gcode_is_word(struct gcode_span *sp, int *pos, const char *word)
+{
+	const char *m;
+	int p;
+
+	p = *pos;
+	while (gcode_span_char(sp, p) == ' ')
+		p += 1;
+
+	for (m = word; *m != '\0'; m++)
+		if (gcode_span_char(sp, p++) != *m)
+			return (0);
+
+	if (gcode_span_char(sp, p) >= '0' && gcode_span_char(sp, p) <= '9')
+		return (0);
+
+	*pos = p;
+
+	return (1);
+}
+
+/* M110 [N<line>]: the next line is expected to be one more. */
+static void
+gcode_m110(struct gcode_span *sp, int pos, int line_no)
+{
+
+	while (gcode_span_char(sp, pos) == ' ')
+		pos += 1;
+
+	if (gcode_span_char(sp, pos) == 'N') {
+		pos += 1;
+		if (gcode_span_int(sp, &pos, &line_no) != 0) {
+			lprintf(LOG_ERR, "Error: bad line number\n");
+			printf("ERROR\n");
+			return;
+		}
+	}
+
+	rx.line_no = line_no;
+	printf("OK\n");
+	printf("COMPLETE\n");
+}
+
+static void
+gcode_resend(const char *why)
+{
+
+	lprintf(LOG_ERR, "Error: %s, last line %d\n", why, rx.line_no);
+	printf("Resend: %d\n", rx.line_no + 1);
+	printf("ERROR\n");
+}
+
+/*
+ * Check the line number and checksum of a numbered line and strip them.
+ * Returns 0 if the command is to be run, 1 if the line has been dealt
+ * with already.
+ */
+static int
+gcode_numbered(struct gcode_span *sp)
+{
+	uint16_t crc;
+	uint8_t sum;
+	int line_no;
+	int check;
+	int star;
+	int pos;
+	int end;
+	int len;
+	int c;
+
+	pos = 0;
+	while (gcode_span_char(sp, pos) == ' ')
+		pos += 1;
+	if (gcode_span_char(sp, pos) != 'N') {
+		if (gcode_is_word(sp, &pos, "M110")) {
+			gcode_m110(sp, pos, 0);
+			return (1);
+		}
+		return (0);
+	}
+
+	/* Only what comes before a comment. */
+	len = gcode_span_len(sp);
+	for (end = 0; end < len; end++)
+		if (gcode_span_char(sp, end) == ';')
+			break;
+
+	for (star = end - 1; star >= 0; star--) {
+		c = gcode_span_char(sp, star);
+		if (c == GCODE_SUM_XOR || c == GCODE_SUM_CRC)
+			break;
+	}
+
+	if (star < 0) {
+		gcode_resend("no checksum");
+		return (1);
+	}
+
+	pos = star + 1;
+	if (gcode_span_int(sp, &pos, &check) != 0) {
+		gcode_resend("bad checksum");
+		return (1);
+	}
+	while (gcode_span_char(sp, pos) == ' ')
+		pos += 1;
+	if (pos != end) {
+		gcode_resend("bad checksum");
+		return (1);
+	}
+
+	sum = 0;
+	crc = 0xffff;
+	for (pos = 0; pos < star; pos++) {
+		sum ^= gcode_span_char(sp, pos);
+		crc = gcode_crc16(crc, gcode_span_char(sp, pos));
+	}
+
+	if (gcode_span_char(sp, star) == GCODE_SUM_XOR ? check != sum :
+	    check != crc) {
+		gcode_resend("checksum mismatch");
+		return (1);
+	}
+
+	pos = 0;
+	while (gcode_span_char(sp, pos) == ' ')
+		pos += 1;
+	pos += 1;
+	if (gcode_span_int(sp, &pos, &line_no) != 0) {
+		gcode_resend("bad line number");
+		return (1);
+	}
+
+	rx.numbered = 1;
+
+	if (gcode_is_word(sp, &pos, "M110")) {
+		gcode_span_cut(sp, 0, star);
+		gcode_m110(sp, pos, line_no);
+		return (1);
+	}
+
+	/*
+	 * Sent again as an acknowledge got lost, it ran already, or is
+	 * queued: complete it once it has run.
+	 */
+	if (line_no <= rx.line_no) {
+		gcode_drain();
+		printf("OK\n");
+		printf("COMPLETE\n");
+		return (1);
+	}
+
+	if (line_no != rx.line_no + 1) {
+		gcode_resend("line number is not last + 1");
+		return (1);
+	}
+
+	rx.line_no = line_no;
+	gcode_span_cut(sp, pos, star);
+
+	return (0);
+}
+
+/*
+ * Parse the body of M820, the lines from pos on, into macro n.  The
+ * macro is left as it is if any line is bad.  An empty body deletes it.
+ */
+static int
+gcode_macro_define(int n, struct gcode_span *sp, int pos)
+{
+	struct gcode_command steps[GCODE_MACRO_STEPS];
+	struct gcode_span line;
+	char *text;
+	int nsteps;
+	int len;
+	int end;
+	int i;
+
+	len = gcode_span_len(sp);
+	while (pos < len && gcode_span_char(sp, pos) == ' ')
+		pos += 1;
+
+	if (n < 0 || n >= GCODE_MACROS) {
+		lprintf(LOG_ERR, "Error: no macro %d\n", n);
+		return (-1);
+	}
+
+	nsteps = 0;
+	for (i = pos; i < len; i = end + 1) {
+		for (end = i; end < len; end++)
+			if (gcode_span_char(sp, end) == '|')
+				break;
+
+		if (nsteps == GCODE_MACRO_STEPS) {
+			lprintf(LOG_ERR, "Error: macro is too long\n");
+			return (-1);
+		}
+
+		line = *sp;
+		gcode_span_cut(&line, i, end);
+		if (gcode_parse(&line, &steps[nsteps]) != 0)
+			return (-1);
+
+		switch (steps[nsteps].type) {
+		case CMD_TYPE_MOVE:
+		case CMD_TYPE_ACTUATE:
+		case CMD_TYPE_SENSOR_READ:
+		case CMD_TYPE_WAIT:
+		case CMD_TYPE_LOG:
+		case CMD_TYPE_DWELL:
+		case CMD_TYPE_ABSOLUTE:
+		case CMD_TYPE_RELATIVE:
+			break;
+		default:
+			lprintf(LOG_ERR, "Error: line %d can't be in a macro\n",
+			    nsteps + 1);
+			return (-1);
+		}
+
+		nsteps += 1;
+	}
+
+	memcpy(macros[n].steps, steps, sizeof(struct gcode_command) * nsteps);
+	macros[n].nsteps = nsteps;
+
+	/* The text is what M822 saves. */
+	text = settings_get()->macros[n];
+	for (i = 0; pos + i < len && i < SETTINGS_MACRO_LEN - 1; i++)
+		text[i] = gcode_span_char(sp, pos + i);
+	text[i] = '\0';
+
+	return (0);
+}
+
+/* M820 Q<n> <line>|<line>|... */
+static int
+gcode_m820(struct gcode_span *sp, int pos)
+{
+	int n;
+
+	while (gcode_span_char(sp, pos) == ' ')
+		pos += 1;
+
+	if (gcode_span_char(sp, pos) != 'Q') {
+		lprintf(LOG_ERR, "Error: no macro number\n");
+		return (-1);
+	}
+	pos += 1;
+
+	if (gcode_span_int(sp, &pos, &n) != 0) {
+		lprintf(LOG_ERR, "Error: bad macro number\n");
+		return (-1);
+	}
+
+	if (gcode_macro_define(n, sp, pos) != 0)
+		return (-1);
+
+	printf("OK\n");
+	printf("COMPLETE\n");
+
+	return (0);
+}
+
+/* Parse the macros saved in the settings. */
+static void
+gcode_macro_load(void)
+{
+	struct gcode_span sp;
+	char *text;
+	int n;
+
+	for (n = 0; n < GCODE_MACROS; n++) {
+		text = settings_get()->macros[n];
+		text[SETTINGS_MACRO_LEN - 1] = '\0';
+		if (text[0] == '\0')
+			continue;
+
+		sp.buf[0] = (const uint8_t *)text;
+		sp.len[0] = strlen(text);
+		sp.buf[1] = NULL;
+		sp.len[1] = 0;
+		if (gcode_macro_define(n, &sp, 0) != 0) {
+			lprintf(LOG_ERR, "Error: saved macro %d is bad\n", n);
+			text[0] = '\0';
+		}
+	}
+}
+
+/* Hand the line from rx.line up to the LF at eol to the parser. */
+static void
+gcode_line(int eol)
+{
+	struct gcode_span sp;
+	int pos;
+	int len;
+
+	len = (eol - rx.line + DMA_BUF_SIZE) % DMA_BUF_SIZE;
+
+	/* Rejected, the host is told so that it goes on. */
+	if (rx.discard) {
+		rx.discard = 0;
+		printf("ERROR\n");
+		return;
+	}
+
+	if (len > MAX_GCODE_LEN) {
+		lprintf(LOG_ERR, "Error: line is too long\n");
+		printf("ERROR\n");
+		return;
+	}
+
+	sp.buf[0] = &dma_buffer[rx.line];
+	sp.buf[1] = dma_buffer;
+	if (rx.line + len > DMA_BUF_SIZE) {
+		sp.len[0] = DMA_BUF_SIZE - rx.line;
+		sp.len[1] = len - sp.len[0];
+	} else {
+		sp.len[0] = len;
+		sp.len[1] = 0;
+	}
+
+	/* CR LF line ends. */
+	if (gcode_span_char(&sp, len - 1) == '\r') {
+		if (sp.len[1] > 0)
+			sp.len[1] -= 1;
+		else
+			sp.len[0] -= 1;
+	}
+
+	if (gcode_numbered(&sp) != 0)
+		return;
+
+	/* Macro lines are not for the parser yet. */
+	pos = 0;
+	if (gcode_is_word(&sp, &pos, "M820")) {
+		if (gcode_m820(&sp, pos) != 0)
+			printf("ERROR\n");
+		return;
+	}
+
+	if (gcode_command(&sp) != 0)
+		printf("ERROR\n");
+}
+
+/* Byte i of the frame that starts at rx.line. */
+static inline int
+gcode_bin_byte(int i)
+{
+
+	return (dma_buffer[(rx.line + i) % DMA_BUF_SIZE]);
+}
+
+static int32_t
+gcode_bin_int32(int i)
+{
+
+	return ((int32_t)(gcode_bin_byte(i) | gcode_bin_byte(i + 1) << 8 |
+	    gcode_bin_byte(i + 2) << 16 |
+	    (uint32_t)gcode_bin_byte(i + 3) << 24));
+}
+
+/* Fill cmd from the move payload.  Returns -1 if it is malformed. */
+static int
+gcode_bin_move(struct gcode_command *cmd, int len)
+{
+	int mask;
+	int i;
+
+	mask = gcode_bin_byte(GCODE_BIN_HDR);
+	i = GCODE_BIN_HDR + 1;
+
+	if (len != 1 + 4 * __builtin_popcount(mask & 0x3f))
+		return (-1);
+
+	cmd->type = CMD_TYPE_MOVE;
+	if (mask & BIN_MOVE_X) {
+		cmd->x = gcode_bin_int32(i);
+		cmd->x_set = 1;
+		i += 4;
+	}
+	if (mask & BIN_MOVE_Y) {
+		cmd->y = gcode_bin_int32(i);
+		cmd->y_set = 1;
+		i += 4;
+	}
+	if (mask & BIN_MOVE_Z) {
+		cmd->z = gcode_bin_int32(i);
+		cmd->z_set = 1;
+		i += 4;
+	}
+	if (mask & BIN_MOVE_H1) {
+		cmd->h1 = gcode_bin_int32(i);
+		cmd->h1_set = 1;
+		i += 4;
+	}
+	if (mask & BIN_MOVE_H2) {
+		cmd->h2 = gcode_bin_int32(i);
+		cmd->h2_set = 1;
+		i += 4;
+	}
+	if (mask & BIN_MOVE_F) {
+		cmd->feed = gcode_bin_int32(i) / 1000.0f;
+		cmd->feed_set = 1;
+	}
+
+	return (0);
+}
+
+/* Take the valid frame at rx.line, the way gcode_command() takes a line. */
+static void
+gcode_bin_frame(int seq, int type, int len)
+{
+	struct gcode_command cmd;
+	int error;
+
+	if (seq == rx.last_seq) {
+		/* Our acknowledge got lost, the host sent it again. */
+		gcode_bin_reply(seq, GCODE_ACK_OK, 0);
+		return;
+	}
+
+	bzero(&cmd, sizeof(struct gcode_command));
+	cmd.binary = 1;
+	cmd.seq = seq;
+
+	error = 0;
+
+	switch (type) {
+	case GCODE_BIN_MOVE:
+		error = gcode_bin_move(&cmd, len);
+		break;
+	case GCODE_BIN_ACTUATE:
+		if (len != 2) {
+			error = -1;
+			break;
+		}
+		cmd.type = CMD_TYPE_ACTUATE;
+		cmd.actuate_target = gcode_bin_byte(GCODE_BIN_HDR);
+		cmd.actuate_value = gcode_bin_byte(GCODE_BIN_HDR + 1);
+		break;
+	case GCODE_BIN_SENSOR:
+		if (len != 1) {
+			error = -1;
+			break;
+		}
+		cmd.type = CMD_TYPE_SENSOR_READ;
+		cmd.sensor_read_target = gcode_bin_byte(GCODE_BIN_HDR);
+		break;
+	case GCODE_BIN_WAIT:
+		cmd.type = CMD_TYPE_WAIT;
+		break;
+	case GCODE_BIN_TEXT:
+		gcode_bin_reply(seq, GCODE_ACK_OK, 0);
+		rx.binary = 0;
+		return;
+	default:
+		error = -1;
+		break;
+	}
+
+	if (error) {
+		gcode_bin_reply(seq, GCODE_ACK_BAD, 0);
+		return;
+	}
+
+	rx.last_seq = seq;
+
+	if (cmd.type == CMD_TYPE_WAIT) {
+		gcode_enqueue(&cmd, 0);
+		mdx_sem_wait(&queue.drain_sem);
+		gcode_reply(&cmd, 0);
+		return;
+	}
+
+	gcode_enqueue(&cmd, 1);
+}
+
+/*
+ * Take the frames received up to cnt.  Returns 1 if the host went back
+ * to text, with the rest of the data left for the line parser.
+ */
+static int
+gcode_bin_process(int cnt)
+{
+	uint16_t crc;
+	int avail;
+	int total;
+	int len;
+	int i;
+
+	for (;;) {
+		avail = (cnt - rx.line + DMA_BUF_SIZE) % DMA_BUF_SIZE;
+		if (avail == 0)
+			return (0);
+
+		/* Out of sync: look for the next frame. */
+		if (gcode_bin_byte(0) != GCODE_BIN_SYNC) {
+			rx.line = (rx.line + 1) % DMA_BUF_SIZE;
+			continue;
+		}
+
+		if (avail < GCODE_BIN_HDR)
+			return (0);
+		len = gcode_bin_byte(1);
+		total = GCODE_BIN_HDR + len + GCODE_BIN_CRC;
+		if (avail < total)
+			return (0);
+
+		crc = 0xffff;
+		for (i = 1; i < GCODE_BIN_HDR + len; i++)
+			crc = gcode_crc16(crc, gcode_bin_byte(i));
+		if (crc != (gcode_bin_byte(total - 2) |
+		    gcode_bin_byte(total - 1) << 8)) {
+			gcode_bin_reply(gcode_bin_byte(2), GCODE_ACK_CRC, 0);
+			rx.line = (rx.line + 1) % DMA_BUF_SIZE;
+			continue;
+		}
+
+		gcode_bin_frame(gcode_bin_byte(2), gcode_bin_byte(3), len);
+		rx.line = (rx.line + total) % DMA_BUF_SIZE;
+
+		if (rx.binary == 0) {
+			rx.scan = rx.line;
+			return (1);
+		}
+	}
+}
+
+/*
+ * Parse the lines received up to cnt.  Returns 1 if the host switched
+ * to binary frames, which start right after the line.
+ */
+static int
+gcode_text_process(int cnt)
+{
+	int end;
+	int eol;
+
+	while (rx.scan != cnt && rx.abort == 0) {
+		end = cnt > rx.scan ? cnt : DMA_BUF_SIZE;
+		eol = gcode_find_eol(rx.scan, end);
+		if (eol == end) {
+			rx.scan = end % DMA_BUF_SIZE;
+			if (rx.discard == 0 &&
+			    (rx.scan - rx.line + DMA_BUF_SIZE) % DMA_BUF_SIZE >
+			    MAX_GCODE_LEN) {
+				lprintf(LOG_ERR, "Error: line is too long\n");
+				rx.discard = 1;
+			}
+			continue;
+		}
+
+		gcode_line(eol);
+		rx.scan = (eol + 1) % DMA_BUF_SIZE;
+		rx.line = rx.scan;
+
+		if (rx.binary)
+			return (1);
+	}
+
+	return (0);
+}
+
+/* Take what has been received up to cnt in the ring. */
+static void
+gcode_process_data(int cnt)
+{
+	int switched;
+
+	do {
+		if (rx.binary)
+			switched = gcode_bin_process(cnt);
+		else
+			switched = gcode_text_process(cnt);
+	} while (switched);
+}
+
+static void
+gcode_dmarecv_init(void)
+{
+	struct stm32f4_dma_conf conf;
+
+	bzero(&conf, sizeof(struct stm32f4_dma_conf));
+	conf.mem0 = (uintptr_t)dma_buffer;
+	conf.sid = GCODE_RX_STREAM;
+	conf.periph_addr = USART1_BASE + USART_DR;
+	conf.dir = 0;
+	conf.channel = 4;
+	conf.circ = 1;
+	conf.psize = 8;
+	conf.nbytes = DMA_BUF_SIZE;
+
+	stm32f4_dma_setup(&dma2_sc, &conf);
+
+	/* Set while the stream is still off. */
+	WR4(DMA2_BASE, GC_DMA_SCR(GCODE_RX_STREAM),
+	    RD4(DMA2_BASE, GC_DMA_SCR(GCODE_RX_STREAM)) |
+	    DMA_SCR_HTIE | DMA_SCR_TCIE);
+
+	stm32f4_dma_control(&dma2_sc, GCODE_RX_STREAM, 1);
+
+	WR4(USART1_BASE, GC_USART_CR1,
+	    RD4(USART1_BASE, GC_USART_CR1) | USART_CR1_IDLEIE);
+}
+
+/*
+ * Ctrl-X: the machine is coming to a stop.  Drop the lines received so
+ * far and the commands queued, and take up again from where the motors
+ * stopped.
+ */
+static void
+gcode_reset(void)
+{
+	struct gcode_command wait;
+
+	rx.abort = 0;
+	gcode_rx_skip();
+
+	bzero(&wait, sizeof(struct gcode_command));
+	wait.type = CMD_TYPE_WAIT;
+	gcode_enqueue(&wait, 0);
+	mdx_sem_wait(&queue.drain_sem);
+	queue.macro_error = 0;
+
+	/* Unless another one came in meanwhile. */
+	critical_enter();
+	if (rx.abort == 0) {
+		queue.flush = 0;
+		pnp_abort_done();
+	}
+	critical_exit();
+
+	printf("RESET\n");
+}
+
+/*
+ * Queue a whole line of output once the console is between lines, so
+ * that it does not end up inside a reply being printed.
+ */
+static void
+gcode_put_line(const char *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < GCODE_LINE_TRIES; i++) {
+		if (board_console_write_line((const uint8_t *)buf, len) == 0)
+			return;
+		mdx_usleep(GCODE_LINE_WAIT);
+	}
+
+	/* Whoever is printing got stuck, better late than never. */
+	board_console_write((const uint8_t *)buf, len);
+}
+
+/* Append one decimal digit per axis set in mask, X first. */
+static int
+gcode_put_mask(char *buf, int mask)
+{
+	int i;
+
+	for (i = 0; i < PNP_NAXES; i++)
+		buf[i] = mask & (1 << i) ? '1' : '0';
+
+	return (PNP_NAXES);
+}
+
+/*
+ * Status report for '?' and M154:
+ *
+ * <Idle|MPos:x,y,z,h1,h2|Mv:xyzij|Bf:planned,queued|Vac:s1,s2|
+ *     Ov:console,log|Ln:n>
+ *
+ * State, position of every axis in mm and degrees to three decimals,
+ * the axes moving, the moves in the planner and the commands waiting
+ * to be run, the component sensors, the characters of output dropped
+ * since power up and the last numbered line taken.
+ */
+static void
+gcode_status(void)
+{
+	int pos[PNP_NAXES];
+	const char *str;
+	char buf[192];
+	int queued;
+	int len;
+	int i;
+
+	queued = (queue.head - queue.tail + GCODE_QUEUE_DEPTH) %
+	    GCODE_QUEUE_DEPTH;
+
+	switch (pnp_get_state()) {
+	case PNP_STATE_HOLD:
+		str = "<Hold|MPos:";
+		break;
+	case PNP_STATE_RUN:
+		str = "<Run|MPos:";
+		break;
+	default:
+		str = queued ? "<Run|MPos:" : "<Idle|MPos:";
+	}
+
+	pnp_get_position(pos);
+
+	len = strlen(str);
+	memcpy(buf, str, len);
+
+	for (i = 0; i < PNP_NAXES; i++) {
+		if (i > 0)
+			buf[len++] = ',';
+		len += gcode_put_fixed(&buf[len], pos[i]);
+	}
+
+	memcpy(&buf[len], "|Mv:", 4);
+	len += 4;
+	len += gcode_put_mask(&buf[len], pnp_get_busy());
+
+	memcpy(&buf[len], "|Bf:", 4);
+	len += 4;
+	len += gcode_put_num(&buf[len], pnp_get_queued());
+	buf[len++] = ',';
+	len += gcode_put_num(&buf[len], queued);
+
+	memcpy(&buf[len], "|Vac:", 5);
+	len += 5;
+	for (i = 1; i <= SENSOR_COUNT; i++) {
+		if (i > 1)
+			buf[len++] = ',';
+		buf[len++] = '0' + sensor_get(i);
+	}
+
+	memcpy(&buf[len], "|Ov:", 4);
+	len += 4;
+	len += gcode_put_num(&buf[len], board_console_overflows());
+	buf[len++] = ',';
+	len += gcode_put_num(&buf[len], board_debug_overflows());
+
+	/* Last numbered line taken. */
+	if (rx.numbered) {
+		memcpy(&buf[len], "|Ln:", 4);
+		len += 4;
+		if (rx.line_no < 0)
+			buf[len++] = '-';
+		len += gcode_put_num(&buf[len],
+		    rx.line_no < 0 ? -(int64_t)rx.line_no : rx.line_no);
+	}
+
+	buf[len++] = '>';
+	buf[len++] = '\r';
+	buf[len++] = '\n';
+
+	gcode_put_line(buf, len);
+}
+
+/*
+ * A component present input changed, sensor is 1 or 2.  Pushed as
+ * "EVENT V:<value> T:<ms>" for S1 and with W: for S2, as M105 replies,
+ * or as a GCODE_ACK_EVENT frame, which has no room for the time.
+ */
+void
+gcode_sensor_event(int sensor, int val, uint32_t ms)
+{
+	char buf[32];
+	int len;
+
+	if (rx.binary) {
+		gcode_bin_reply(0, GCODE_ACK_EVENT, sensor << 4 | val);
+		return;
+	}
+
+	len = 6;
+	memcpy(buf, "EVENT ", len);
+	buf[len++] = sensor == 1 ? 'V' : 'W';
+	buf[len++] = ':';
+	buf[len++] = '0' + val;
+	memcpy(&buf[len], " T:", 3);
+	len += 3;
+	len += gcode_put_num(&buf[len], ms);
+	buf[len++] = '\r';
+	buf[len++] = '\n';
+
+	gcode_put_line(buf, len);
+}
+
+static void
+gcode_status_thread(void *arg)
+{
+
+	while (1) {
+		/* Woken by '?', or when the next M154 report is due. */
+		if (report_us == 0)
+			mdx_sem_wait(&status_sem);
+		else
+			mdx_sem_timedwait(&status_sem, report_us);
+
+		/* Frames only while in binary mode. */
+		if (rx.binary)
+			continue;
+
+		gcode_status();
+	}
+}
+
+static int
+gcode_queue_init(void)
+{
+	struct thread *td;
+
+	bzero(&queue, sizeof(struct gcode_queue));
+	mdx_sem_init(&queue.free_sem, GCODE_QUEUE_DEPTH);
+	mdx_sem_init(&queue.used_sem, 0);
+	mdx_sem_init(&queue.drain_sem, 0);
+
+	td = mdx_thread_create("gcode", 1 /* prio */, 500 /* quantum */,
+	    4096 /* stack */, gcode_exec_thread, NULL);
+	if (td == NULL) {
+		printf("%s: Failed to create gcode thread\n", __func__);
+		return (-1);
+	}
+
+	mdx_sched_add(td);
+
+	mdx_sem_init(&status_sem, 0);
+
+	td = mdx_thread_create("status", 1 /* prio */, 500 /* quantum */,
+	    1024 /* stack */, gcode_status_thread, NULL);
+	if (td == NULL) {
+		printf("%s: Failed to create status thread\n", __func__);
+		return (-1);
+	}
+
+	mdx_sched_add(td);
+
+	printf("gcode: command queue depth %d\n", GCODE_QUEUE_DEPTH);
+
+	return (0);
+}
+
+int
+gcode_mainloop(void)
+{
+	int error;
+
+	bzero(&rx, sizeof(struct gcode_rx));
+
+	error = gcode_queue_init();
+	if (error)
+		return (error);
+
+	error = sensor_init();
+	if (error)
+		return (error);
+
+	gcode_macro_load();
+
+	mdx_sem_init(&rx_sem, 0);
+
+	gcode_dmarecv_init();
+
+	while (1) {
+		/* Sleep until the receiver has something for us. */
+		mdx_sem_wait(&rx_sem);
+
+		if (rx.abort)
+			gcode_reset();
 
-		mdx_usleep(10000);
+		gcode_process_data(rx.ready);
 	}
 
 	return (0);
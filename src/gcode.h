@@ -32,6 +32,35 @@ struct gcode_command {
 #define	CMD_TYPE_MOVE		1
 #define	CMD_TYPE_ACTUATE	2
 #define	CMD_TYPE_SENSOR_READ	3
+#define	CMD_TYPE_WAIT		4	/* M400 */
+#define	CMD_TYPE_LOG		5	/* M111 */
+#define	CMD_TYPE_BAUD		6	/* M575 */
+#define	CMD_TYPE_BINARY		7	/* M801 */
+#define	CMD_TYPE_EVENTS		8	/* M802 */
+#define	CMD_TYPE_MACRO		9	/* M821, queued as the end of it */
+#define	CMD_TYPE_MACRO_SAVE	10	/* M822 */
+#define	CMD_TYPE_NO_EVENTS	11	/* M803 */
+#define	CMD_TYPE_DWELL		12	/* G4 */
+#define	CMD_TYPE_HOME		13	/* G28 */
+#define	CMD_TYPE_ABSOLUTE	14	/* G90 */
+#define	CMD_TYPE_RELATIVE	15	/* G91 */
+#define	CMD_TYPE_STEPS		16	/* M92 */
+#define	CMD_TYPE_POSITION	17	/* M114 */
+#define	CMD_TYPE_FIRMWARE	18	/* M115 */
+#define	CMD_TYPE_MAX_FEED	19	/* M203 */
+#define	CMD_TYPE_ACCEL		20	/* M204 */
+#define	CMD_TYPE_REPORT		21	/* M154 */
+#define	CMD_TYPE_JUNCTION	22	/* M205 */
+#define	CMD_TYPE_BLEND		23	/* M804 */
+#define	CMD_TYPE_SHAPER		24	/* M593 */
+#define	CMD_TYPE_RESONANCE	25	/* M958 */
+#define	CMD_TYPE_MODULAR	26	/* M805 */
+#define	CMD_TYPES		27
+
+	/* Received as a binary frame, replies go the same way. */
+	int binary;
+	int seq;
+	int acked;	/* The OK has gone out. */
 
 	int x;
 	int y;
@@ -44,6 +73,9 @@ struct gcode_command {
 	int h1_set;
 	int h2_set;
 
+	float feed;	/* mm/min */
+	int feed_set;
+
 	int actuate_target;
 #define	PNP_ACTUATE_TARGET_PUMP		1
 #define	PNP_ACTUATE_TARGET_AVAC1	2
@@ -53,8 +85,45 @@ struct gcode_command {
 	int actuate_value;
 
 	int sensor_read_target;
+
+	/* M111: log level and category. */
+	int log_level;
+	int log_level_set;
+	int log_cat;
+	int log_cat_set;
+
+	/* M575: USART1 rate. */
+	int baud;
+	int baud_set;
+
+	/* G4, M204: P and S as given, fixed point. */
+	int64_t p;
+	int64_t s;
+	int p_set;
+	int s_set;
+
+	/* M593: damping ratio, fixed point, and shaper type. */
+	int64_t d;
+	int d_set;
+	int t;
+	int t_set;
+
+	/* M821: macro number. */
+	int macro;
+
+	/* Bare axes of a macro line, and whether it is one. */
+	int params;
+#define	CMD_PARAM_X		(1 << 0)
+#define	CMD_PARAM_Y		(1 << 1)
+#define	CMD_PARAM_Z		(1 << 2)
+#define	CMD_PARAM_H1		(1 << 3)
+#define	CMD_PARAM_H2		(1 << 4)
+	int macro_step;
 };
 
 int gcode_mainloop(void);
+void gcode_usart_intr(void *arg, int irq);
+void gcode_dma_intr(void *arg, int irq);
+void gcode_sensor_event(int sensor, int val, uint32_t ms);
 
 #endif /* !_SRC_GCODE_H_ */
@@ -35,6 +35,9 @@ static const struct gpio_pin neodenyy1_pins[] = {
 	{ PORT_A, 9, MODE_ALT, 7, PULLUP }, /* USART1_TX */
 	{ PORT_A, 10, MODE_ALT, 7, PULLUP }, /* USART1_RX */
 
+	/* Diagnostics, transmit only. */
+	{ PORT_C, 10, MODE_ALT, 8, PULLUP }, /* UART4_TX */
+
 	/* Placement Head. */
 	{ PORT_E, 2, MODE_OUT, 0, PULLDOWN }, /* Air 1 */
 	{ PORT_E, 1, MODE_OUT, 0, PULLDOWN }, /* Air 2 */
@@ -0,0 +1,113 @@
+/*-
+ * Copyright (c) 2024 Ruslan Bukin <br@bsdpad.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/systm.h>
+
+#include <machine/stdarg.h>
+
+#include "board.h"
+#include "log.h"
+
+/* Longest line, longer ones are cut. */
+#define	LOG_LINE		128
+
+/* The log has a port of its own, it costs the host link nothing. */
+int log_levels[LOG_NCATS] = {
+	[LOG_GCODE] = LOG_INFO,
+	[LOG_MOTION] = LOG_INFO,
+};
+
+static const char *log_names[LOG_NCATS] = {
+	[LOG_GCODE] = "gcode",
+	[LOG_MOTION] = "motion",
+};
+
+/*
+ * Errors answer the command that failed, they go to the host.  The rest
+ * goes to the diagnostics port, or the console while it is not up yet.
+ */
+void
+log_out(int level, const char *fmt, ...)
+{
+	char out[LOG_LINE * 2];
+	char buf[LOG_LINE];
+	va_list ap;
+	int len;
+	int i;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (level == LOG_ERR) {
+		printf("%s", buf);
+		return;
+	}
+
+	/* Line ends as the console has them. */
+	len = 0;
+	for (i = 0; buf[i] != '\0'; i++) {
+		if (buf[i] == '\n')
+			out[len++] = '\r';
+		out[len++] = buf[i];
+	}
+
+	if (board_debug_write((const uint8_t *)out, len) != 0)
+		printf("%s", buf);
+}
+
+/* Set the level of a category, or of all of them if cat is -1. */
+int
+log_set_level(int cat, int level)
+{
+	int i;
+
+	if (level < LOG_ERR || level > LOG_DEBUG)
+		return (-1);
+
+	if (cat == -1) {
+		for (i = 0; i < LOG_NCATS; i++)
+			log_levels[i] = level;
+		return (0);
+	}
+
+	if (cat < 0 || cat >= LOG_NCATS)
+		return (-1);
+
+	log_levels[cat] = level;
+
+	return (0);
+}
+
+void
+log_report(void)
+{
+	int i;
+
+	for (i = 0; i < LOG_NCATS; i++)
+		printf("log C%d %s: S%d\n", i, log_names[i], log_levels[i]);
+}
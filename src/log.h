@@ -0,0 +1,59 @@
+/*-
+ * Copyright (c) 2024 Ruslan Bukin <br@bsdpad.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SRC_LOG_H_
+#define	_SRC_LOG_H_
+
+/* Log levels. */
+#define	LOG_ERR			0
+#define	LOG_WARN		1
+#define	LOG_INFO		2
+#define	LOG_DEBUG		3
+
+/* Categories, each has a level of its own. */
+#define	LOG_GCODE		0
+#define	LOG_MOTION		1
+#define	LOG_NCATS		2
+
+extern int log_levels[LOG_NCATS];
+
+/*
+ * The arguments are only evaluated, and floats only formatted, when the
+ * category logs at that level.
+ */
+#define	log_printf(cat, level, fmt, ...)				\
+	do {								\
+		if ((level) <= log_levels[(cat)])			\
+			log_out((level), fmt, ##__VA_ARGS__);		\
+	} while (0)
+
+#define	log_enabled(cat, level)	((level) <= log_levels[(cat)])
+
+void log_out(int level, const char *fmt, ...);
+int log_set_level(int cat, int level);
+void log_report(void);
+
+#endif /* !_SRC_LOG_H_ */
@@ -0,0 +1,592 @@
+/*-
+ * Copyright (c) 2024 Ruslan Bukin <br@bsdpad.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Look-ahead motion planner.
+ *
+ * Moves are queued as straight blocks.  Every time a block is added the
+ * entry speeds of the blocks that are not executing yet are replanned:
+ * a backward pass makes sure each block can still slow down to the
+ * entry speed of the next one (and the last one to a standstill), a
+ * forward pass makes sure each entry speed can be reached from the
+ * previous one.  Both take the jerk limit into account, so every block
+ * can be played as an S-curve profile.  Junction speeds are limited by
+ * the junction deviation.
+ *
+ * A block is frozen once the step generators start reading it.  At that
+ * point its exit speed is fixed: it flows into the next block if there
+ * is one already, otherwise the run of blocks ends with it.
+ *
+ * A stepper can not reverse its direction pin in the middle of a step
+ * stream, so a block that reverses any axis always starts from a
+ * standstill.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/systm.h>
+#include <sys/sem.h>
+
+#include <lib/msun/src/math.h>
+
+#include "planner.h"
+
+#define	PLANNER_DEBUG
+#undef	PLANNER_DEBUG
+
+#ifdef	PLANNER_DEBUG
+#define	dprintf(fmt, ...)	printf(fmt, ##__VA_ARGS__)
+#else
+#define	dprintf(fmt, ...)
+#endif
+
+#define	PLANNER_ALL_AXES	((1 << PLANNER_NAXES) - 1)
+
+struct planner_state {
+	struct planner_block blocks[PLANNER_DEPTH];
+	int head;		/* Oldest block. */
+	int count;
+	mdx_sem_t lock;
+	mdx_sem_t free;		/* Free slots. */
+
+	struct planner_axis axis[PLANNER_NAXES];
+	int reversible;		/* Axes that can reverse within a run. */
+	float junction_deviation;
+
+	/* End of the last queued block. */
+	int pos[PLANNER_NAXES];
+	int last_dir[PLANNER_NAXES];	/* -1 if never moved. */
+	float last_unit[PLANNER_NAXES];
+	float last_nominal;
+	int last_axes;			/* Axes moved by the last block. */
+	int have_last;
+};
+
+static struct planner_state planner;
+
+static inline int
+planner_idx(int i)
+{
+
+	return ((planner.head + i) % PLANNER_DEPTH);
+}
+
+void
+planner_set_axis(int axis, float units_per_step, float max_vel,
+    float max_accel, float max_jerk)
+{
+	struct planner_axis *pa;
+
+	pa = &planner.axis[axis];
+	pa->units_per_step = units_per_step;
+	pa->max_vel = max_vel;
+	pa->max_accel = max_accel;
+	pa->max_jerk = max_jerk;
+}
+
+/*
+ * The step generator of the axis can change its direction in the middle
+ * of a run, so reversing after a block the axis does not take part in
+ * does not need a standstill.
+ */
+void
+planner_set_reversible(int axis, int reversible)
+{
+
+	if (reversible)
+		planner.reversible |= (1 << axis);
+	else
+		planner.reversible &= ~(1 << axis);
+}
+
+/* Taken by the blocks added after. */
+void
+planner_set_junction_deviation(float mm)
+{
+
+	planner.junction_deviation = mm;
+}
+
+float
+planner_get_junction_deviation(void)
+{
+
+	return (planner.junction_deviation);
+}
+
+/*
+ * Only valid while nothing is queued.  The direction of the axis is
+ * unknown afterwards, so its next move starts from a standstill.
+ */
+void
+planner_set_position(int axis, int steps)
+{
+
+	planner.pos[axis] = steps;
+	planner.last_dir[axis] = -1;
+}
+
+int
+planner_get_position(int axis)
+{
+
+	return (planner.pos[axis]);
+}
+
+int
+planner_count(void)
+{
+
+	return (planner.count);
+}
+
+/*
+ * Maximum speed through the corner between the previous block and this
+ * one, so that the path deviates from the sharp corner by no more than
+ * the junction deviation when taken at the block acceleration.
+ */
+static float
+planner_junction_speed(struct planner_block *b)
+{
+	float cos_theta;
+	float sin_half;
+	float v2;
+	float v;
+	int i;
+
+	cos_theta = 0.0f;
+	for (i = 0; i < PLANNER_NAXES; i++)
+		cos_theta -= planner.last_unit[i] * b->unit[i];
+
+	if (cos_theta > 0.999999f)
+		/* Full reversal. */
+		return (0.0f);
+
+	v = b->nominal < planner.last_nominal ? b->nominal :
+	    planner.last_nominal;
+
+	if (cos_theta < -0.999999f)
+		/* Straight line. */
+		return (v);
+
+	sin_half = sqrtf(0.5f * (1.0f - cos_theta));
+	v2 = b->accel * planner.junction_deviation * sin_half /
+	    (1.0f - sin_half);
+	if (v2 < v * v)
+		v = sqrtf(v2);
+
+	return (v);
+}
+
+/*
+ * Replan entry speeds of the blocks that are not frozen yet.  The last
+ * block always has to stop, so every frozen block can still end the run
+ * whatever arrives later.  Called with the lock held.
+ */
+static void
+planner_recalculate(void)
+{
+	struct planner_block *prev;
+	struct planner_block *next;
+	struct planner_block *b;
+	float v;
+	int first;
+	int i;
+
+	for (first = 0; first < planner.count; first++)
+		if ((planner.blocks[planner_idx(first)].flags &
+		    PLANNER_F_FROZEN) == 0)
+			break;
+	if (first == planner.count)
+		return;
+
+	/*
+	 * The first unfrozen block enters at the exit speed of the frozen
+	 * one before it, or from a standstill if the run ends there.
+	 */
+	b = &planner.blocks[planner_idx(first)];
+	if (first == 0 || (b->flags & PLANNER_F_STOP))
+		b->entry = 0.0f;
+	else {
+		prev = &planner.blocks[planner_idx(first - 1)];
+		if (prev->flags & PLANNER_F_RUN_END)
+			b->entry = 0.0f;
+	}
+
+	/* Backward pass. */
+	v = 0.0f;
+	for (i = planner.count - 1; i > first; i--) {
+		b = &planner.blocks[planner_idx(i)];
+		b->entry = profile_reach(v, b->length, b->accel, b->jerk);
+		if (b->entry > b->max_entry)
+			b->entry = b->max_entry;
+		v = b->entry;
+	}
+
+	/* Forward pass. */
+	for (i = first; i < planner.count - 1; i++) {
+		b = &planner.blocks[planner_idx(i)];
+		next = &planner.blocks[planner_idx(i + 1)];
+		v = profile_reach(b->entry, b->length, b->accel, b->jerk);
+		if (next->entry > v)
+			next->entry = v;
+	}
+}
+
+/*
+ * Queue a move to the target position, in steps.  A non-zero feed caps
+ * the path speed below the axis limits.  Sleeps while the queue is full.
+ * Returns 0 if queued or there was nothing to do.
+ */
+int
+planner_add(const int *target, float feed, int flags)
+{
+	struct planner_axis *pa;
+	struct planner_block *b;
+	float delta[PLANNER_NAXES];
+	float length;
+	float v;
+	int steps;
+	int i;
+
+	length = 0.0f;
+	for (i = 0; i < PLANNER_NAXES; i++) {
+		steps = target[i] - planner.pos[i];
+		delta[i] = steps * planner.axis[i].units_per_step;
+		length += delta[i] * delta[i];
+	}
+	if (length == 0.0f)
+		return (0);
+
+	mdx_sem_wait(&planner.free);
+	mdx_sem_wait(&planner.lock);
+
+	b = &planner.blocks[planner_idx(planner.count)];
+	bzero(b, sizeof(struct planner_block));
+
+	b->length = sqrtf(length);
+	b->nominal = 0.0f;
+	b->accel = 0.0f;
+	b->jerk = 0.0f;
+	b->flags = flags & PLANNER_F_STOP;
+
+	for (i = 0; i < PLANNER_NAXES; i++) {
+		pa = &planner.axis[i];
+		steps = target[i] - planner.pos[i];
+		b->dir[i] = steps > 0 ? 1 : 0;
+		b->steps[i] = abs(steps);
+		b->unit[i] = delta[i] / b->length;
+		if (steps == 0)
+			continue;
+
+		/* Limit the path speed by every axis taking part. */
+		v = pa->max_vel / fabsf(b->unit[i]);
+		if (b->nominal == 0.0f || v < b->nominal)
+			b->nominal = v;
+		v = pa->max_accel / fabsf(b->unit[i]);
+		if (b->accel == 0.0f || v < b->accel)
+			b->accel = v;
+		v = pa->max_jerk / fabsf(b->unit[i]);
+		if (b->jerk == 0.0f || v < b->jerk)
+			b->jerk = v;
+
+		if (planner.last_dir[i] == -1 ||
+		    (planner.last_dir[i] != b->dir[i] &&
+		    ((planner.reversible & (1 << i)) == 0 ||
+		    (planner.last_axes & (1 << i)))))
+			b->flags |= PLANNER_F_STOP;
+		planner.last_dir[i] = b->dir[i];
+		planner.pos[i] = target[i];
+	}
+
+	if (feed > 0.0f && feed < b->nominal)
+		b->nominal = feed;
+
+	if (planner.have_last == 0 || (b->flags & PLANNER_F_STOP))
+		b->max_entry = 0.0f;
+	else
+		b->max_entry = planner_junction_speed(b);
+
+	dprintf("%s: len %d um, nominal %d, max entry %d\n", __func__,
+	    (int)(b->length * 1000), (int)b->nominal, (int)b->max_entry);
+
+	planner.last_axes = 0;
+	for (i = 0; i < PLANNER_NAXES; i++) {
+		planner.last_unit[i] = b->unit[i];
+		if (b->steps[i])
+			planner.last_axes |= (1 << i);
+	}
+	planner.last_nominal = b->nominal;
+	planner.have_last = 1;
+
+	planner.count += 1;
+	planner_recalculate();
+
+	mdx_sem_post(&planner.lock);
+
+	return (0);
+}
+
+/*
+ * Make the last queued block end early, at target, which has to lie on
+ * it.  Only possible while no axis has started on the block, and if the
+ * block before it is already playing, only if the shorter block can still
+ * stop from the entry speed promised to it.  Returns 0 on success.
+ */
+int
+planner_cut(const int *target)
+{
+	struct planner_block *prev;
+	struct planner_block *b;
+	int steps[PLANNER_NAXES];
+	float length;
+	float delta;
+	int back;
+	int i;
+
+	mdx_sem_wait(&planner.lock);
+
+	if (planner.count == 0)
+		goto fail;
+
+	b = &planner.blocks[planner_idx(planner.count - 1)];
+	if (b->flags & PLANNER_F_FROZEN)
+		goto fail;
+
+	length = 0.0f;
+	for (i = 0; i < PLANNER_NAXES; i++) {
+		/* Going back from the end, against the block direction. */
+		back = target[i] - planner.pos[i];
+		if (b->dir[i] ? back > 0 : back < 0)
+			goto fail;
+		steps[i] = b->steps[i] - abs(back);
+		if (steps[i] < 0)
+			goto fail;
+		delta = steps[i] * planner.axis[i].units_per_step;
+		length += delta * delta;
+	}
+	if (length == 0.0f)
+		goto fail;
+	length = sqrtf(length);
+
+	if (planner.count > 1) {
+		prev = &planner.blocks[planner_idx(planner.count - 2)];
+		if ((prev->flags & (PLANNER_F_FROZEN | PLANNER_F_RUN_END)) ==
+		    PLANNER_F_FROZEN &&
+		    profile_reach(0.0f, length, b->accel, b->jerk) < b->entry)
+			goto fail;
+	}
+
+	b->length = length;
+	planner.last_axes = 0;
+	for (i = 0; i < PLANNER_NAXES; i++) {
+		b->steps[i] = steps[i];
+		if (steps[i])
+			planner.last_axes |= (1 << i);
+		planner.pos[i] = target[i];
+	}
+
+	planner_recalculate();
+
+	mdx_sem_post(&planner.lock);
+
+	return (0);
+
+fail:
+	mdx_sem_post(&planner.lock);
+
+	return (-1);
+}
+
+/*
+ * Fix the profile of a block that starts executing.  Called with the lock
+ * held, the entry speed is final already.
+ */
+static void
+planner_freeze(int i)
+{
+	struct planner_block *next;
+	struct planner_block *b;
+	float v;
+
+	b = &planner.blocks[planner_idx(i)];
+
+	b->exit = 0.0f;
+	b->flags |= PLANNER_F_RUN_END;
+
+	if (i + 1 < planner.count) {
+		next = &planner.blocks[planner_idx(i + 1)];
+		if ((next->flags & PLANNER_F_STOP) == 0) {
+			v = profile_reach(b->entry, b->length, b->accel,
+			    b->jerk);
+			if (next->entry > v)
+				next->entry = v;
+			b->exit = next->entry;
+			b->flags &= ~PLANNER_F_RUN_END;
+		}
+	}
+
+	profile_plan(&b->profile, b->length, b->entry, b->exit, b->nominal,
+	    b->accel, b->jerk);
+
+	b->flags |= PLANNER_F_FROZEN;
+	b->pending = PLANNER_ALL_AXES;
+
+	dprintf("%s: entry %d exit %d peak %d, %d us\n", __func__,
+	    (int)b->entry, (int)b->exit, (int)b->profile.peak,
+	    (int)(b->profile.duration * 1000000));
+}
+
+/* Start a run of blocks from a standstill at the oldest one. */
+struct planner_block *
+planner_begin(void)
+{
+	struct planner_block *b;
+
+	mdx_sem_wait(&planner.lock);
+
+	if (planner.count == 0) {
+		mdx_sem_post(&planner.lock);
+		return (NULL);
+	}
+
+	b = &planner.blocks[planner.head];
+	b->entry = 0.0f;
+	planner_freeze(0);
+
+	mdx_sem_post(&planner.lock);
+
+	return (b);
+}
+
+/* The block played after b, or NULL if the run ends with b. */
+struct planner_block *
+planner_next(struct planner_block *b)
+{
+	struct planner_block *next;
+	int i;
+
+	if (b->flags & PLANNER_F_RUN_END)
+		return (NULL);
+
+	mdx_sem_wait(&planner.lock);
+
+	i = (b - planner.blocks - planner.head + PLANNER_DEPTH) %
+	    PLANNER_DEPTH + 1;
+	next = &planner.blocks[planner_idx(i)];
+	if ((next->flags & PLANNER_F_FROZEN) == 0)
+		planner_freeze(i);
+
+	mdx_sem_post(&planner.lock);
+
+	return (next);
+}
+
+/* An axis is done reading a block. */
+void
+planner_release(struct planner_block *b, int axis)
+{
+	int retired;
+
+	mdx_sem_wait(&planner.lock);
+
+	b->pending &= ~(1 << axis);
+
+	retired = 0;
+	while (planner.count > 0) {
+		b = &planner.blocks[planner.head];
+		if ((b->flags & PLANNER_F_FROZEN) == 0 || b->pending)
+			break;
+		planner.head = (planner.head + 1) % PLANNER_DEPTH;
+		planner.count -= 1;
+		retired += 1;
+	}
+
+	mdx_sem_post(&planner.lock);
+
+	while (retired--)
+		mdx_sem_post(&planner.free);
+}
+
+/* Drop every queued block.  Only valid between runs. */
+void
+planner_flush(void)
+{
+	int n;
+
+	mdx_sem_wait(&planner.lock);
+	n = planner.count;
+	planner.count = 0;
+	planner.have_last = 0;
+	planner.last_axes = 0;
+	mdx_sem_post(&planner.lock);
+
+	while (n--)
+		mdx_sem_post(&planner.free);
+}
+
+/*
+ * Direction of an axis for the run starting at the oldest block, or -1
+ * if the axis does not move in the blocks queued so far.
+ */
+int
+planner_run_dir(int axis)
+{
+	struct planner_block *b;
+	int dir;
+	int i;
+
+	mdx_sem_wait(&planner.lock);
+
+	dir = -1;
+	for (i = 0; i < planner.count; i++) {
+		b = &planner.blocks[planner_idx(i)];
+		if (i > 0 && (b->flags & PLANNER_F_STOP))
+			break;
+		if (b->steps[axis]) {
+			dir = b->dir[axis];
+			break;
+		}
+	}
+
+	mdx_sem_post(&planner.lock);
+
+	return (dir);
+}
+
+void
+planner_init(void)
+{
+	int i;
+
+	bzero(&planner, sizeof(struct planner_state));
+
+	mdx_sem_init(&planner.lock, 1);
+	mdx_sem_init(&planner.free, PLANNER_DEPTH);
+
+	planner.junction_deviation = PLANNER_JUNCTION_DEVIATION;
+	for (i = 0; i < PLANNER_NAXES; i++)
+		planner.last_dir[i] = -1;
+}
@@ -0,0 +1,88 @@
+/*-
+ * Copyright (c) 2024 Ruslan Bukin <br@bsdpad.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SRC_PLANNER_H_
+#define	_SRC_PLANNER_H_
+
+#include "profile.h"
+
+#define	PLANNER_NAXES		5
+#define	PLANNER_DEPTH		16
+
+/* Default junction deviation, mm. */
+#define	PLANNER_JUNCTION_DEVIATION	0.05f
+
+struct planner_axis {
+	float units_per_step;	/* mm or deg */
+	float max_vel;		/* units/s */
+	float max_accel;	/* units/s^2 */
+	float max_jerk;		/* units/s^3 */
+};
+
+/*
+ * One straight move.  Velocities and lengths are in path units: the
+ * euclidean norm over all axes, with degrees counted as millimeters.
+ */
+struct planner_block {
+	int steps[PLANNER_NAXES];	/* Steps to make, per axis. */
+	int dir[PLANNER_NAXES];		/* 1 if moving towards +. */
+	float unit[PLANNER_NAXES];	/* Unit vector. */
+	float length;
+	float nominal;
+	float accel;
+	float jerk;
+	float max_entry;		/* Junction limit. */
+
+	/* Planned profile. */
+	float entry;
+	float exit;
+	struct profile profile;
+
+	int flags;
+#define	PLANNER_F_STOP		(1 << 0)	/* Start from standstill. */
+#define	PLANNER_F_FROZEN	(1 << 1)	/* Profile in use. */
+#define	PLANNER_F_RUN_END	(1 << 2)	/* Stop after this block. */
+	int pending;			/* Axes still reading the block. */
+};
+
+void planner_init(void);
+void planner_set_axis(int axis, float units_per_step, float max_vel,
+    float max_accel, float max_jerk);
+void planner_set_reversible(int axis, int reversible);
+void planner_set_junction_deviation(float mm);
+float planner_get_junction_deviation(void);
+void planner_set_position(int axis, int steps);
+int planner_get_position(int axis);
+int planner_add(const int *target, float feed, int flags);
+int planner_cut(const int *target);
+int planner_count(void);
+void planner_flush(void);
+struct planner_block *planner_begin(void);
+struct planner_block *planner_next(struct planner_block *b);
+void planner_release(struct planner_block *b, int axis);
+int planner_run_dir(int axis);
+
+#endif /* !_SRC_PLANNER_H_ */
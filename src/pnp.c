@@ -37,7 +37,11 @@
 
 #include "board.h"
 #include "gcode.h"
+#include "planner.h"
+#include "log.h"
 #include "pnp.h"
+#include "shaper.h"
+#include "stepgen.h"
 #include "trig.h"
 
 #define	PNP_DEBUG
@@ -49,6 +53,9 @@
 #define	dprintf(fmt, ...)
 #endif
 
+#define	lprintf(level, fmt, ...)	\
+	log_printf(LOG_MOTION, (level), fmt, ##__VA_ARGS__)
+
 #define	PNP_MAX_X_NM		(364000000)	/* nanometers */
 #define	PNP_MAX_Y_NM		(368000000)	/* nanometers */
 #define	CAM_RADIUS		(15000000)
@@ -77,32 +84,175 @@
 #define	PNP_STEPS_H_MIN		(-180000000 / PNP_NR_STEP_DEG)
 #define	PNP_STEPS_H_MAX		(180000000 / PNP_NR_STEP_DEG)
 
+/* Planner limits: mm/s, mm/s^2 and mm/s^3 on X/Y, degrees otherwise. */
+#define	PNP_XY_MAX_VEL		300.0f
+#define	PNP_XY_MAX_ACCEL	5000.0f
+#define	PNP_XY_MAX_JERK		200000.0f
+#define	PNP_Z_MAX_VEL		450.0f
+#define	PNP_Z_MAX_ACCEL		20000.0f
+#define	PNP_Z_MAX_JERK		1000000.0f
+#define	PNP_NR_MAX_VEL		450.0f
+#define	PNP_NR_MAX_ACCEL	20000.0f
+#define	PNP_NR_MAX_JERK		1000000.0f
+
+/*
+ * Idle time is played as no-pulse timer cycles of at most this length.
+ * It bounds how far ahead of the motors the step tables are computed,
+ * and so how early blocks are frozen.
+ */
+#define	PNP_IDLE_TICKS		(STEPGEN_TICK_FREQ / 4000)
+#define	PNP_MIN_TICKS		(STEPGEN_PULSE_TICKS * 2)
+
+/* Idle cycle the direction pin changes in, before the first step. */
+#define	PNP_DIR_TICKS		(STEPGEN_TICK_FREQ / 50000)
+
+/*
+ * Path sampling period, s.  Step times are interpolated between samples,
+ * which is well below a step off at any of the planner limits.
+ */
+#define	PNP_SAMPLE_TIME		0.0005f
+#define	PNP_SAMPLE_TICKS	(STEPGEN_TICK_FREQ / 2000)
+
+/* Unshaped samples kept for the input shaper, bounds its duration. */
+#define	PNP_SHAPER_HIST		256
+
+/* Damping ratio of the gantry until M593 D says otherwise. */
+#define	PNP_SHAPER_DAMPING	0.1f
+
+/* Resonance test: frequency sweep, Hz, at the same peak acceleration. */
+#define	PNP_RES_FREQ_MIN	10
+#define	PNP_RES_FREQ_MAX	100
+#define	PNP_RES_FREQ_STEP	5
+#define	PNP_RES_ACCEL		2000.0f		/* mm/s^2 */
+#define	PNP_RES_PERIODS		20
+#define	PNP_RES_PAUSE		500000		/* us */
+
+/* Wait for more moves before starting a single queued one, us. */
+#define	PNP_START_DELAY		10000
+
+/*
+ * Blended moves: X/Y travel starts once Z has risen within PNP_SAFE_Z
+ * of the top, and Z starts lowering before the travel is over.  Z and
+ * the travel overlap for up to PNP_BLEND_MM of it at each end.  M804
+ * turns it off or sets another safe Z.
+ */
+#define	PNP_SAFE_Z_NM		(3000000)
+#define	PNP_BLEND_MM		10.0f
+
+/*
+ * The cam turns the Z motor angle into nozzle travel at a rate that is
+ * highest mid-way and falls to nothing at the top.  Z strokes run at the
+ * motor limits, the last PNP_Z_LAND_NM down to the target are slowed to
+ * PNP_Z_LAND_VEL of nozzle travel, so parts and pads are touched gently.
+ */
+#define	PNP_Z_LAND_NM		(1000000)
+#define	PNP_Z_LAND_VEL		25.0f		/* mm/s */
+
+/*
+ * Feed hold.  The step tables are computed in run time, which is mapped
+ * to real time when the timer cycles are written.  On a hold the rate
+ * run time goes at falls from 1 to 0 over PNP_HOLD_TICKS of real time,
+ * so all the axes slow down together along the path, and the run
+ * stands still once it is PNP_HOLD_TICKS / 2 further.  Resuming speeds
+ * back up the same way.  This adds the speed over the ramp time to the
+ * deceleration, 3000 mm/s^2 at the X/Y speed limit.  A cycle of c run
+ * ticks lasts no more than sqrt(2 * PNP_HOLD_TICKS * c) real ones, which
+ * keeps the ramps within the 16 bit timers.
+ */
+#define	PNP_HOLD_TICKS		(STEPGEN_TICK_FREQ / 10)
+
+/* Homing speeds, mm/s on X/Y and degrees/s on Z. */
+#define	PNP_HOME_FAST		60.0f
+#define	PNP_HOME_BACKOFF	30.0f
+#define	PNP_HOME_SLOW		6.0f
+#define	PNP_HOME_Z		67.5f
+
+/* A constant speed move of a single motor, used for homing. */
 struct move_task {
 	int steps;
 	int check_home;
 	int direction;
-	int speed;
+	float speed;	/* mm/s or deg/s */
 	mdx_sem_t task_compl_sem;
-	int speed_control;
+
+	/* Period table state. */
+	int stream;
+	int fill_half;
+	int fill_done;
 
 	/* Result */
 	int home_found;
+	int error;
+};
+
+/* Step table producer, walking the planner blocks of a run. */
+struct pnp_stream {
+	struct planner_block *blk;
+	int step;		/* Steps made in blk. */
+	int blk_done;		/* All of blk is described. */
+	int64_t blk_start;	/* Ticks from the start of the run. */
+	int64_t open;		/* Start of the cycle being described. */
+	int64_t real;		/* The same in real time, see pnp_hold. */
+	uint32_t gap;		/* Ticks left until the next event. */
+	int pulse;		/* The open cycle starts with a step, +/-1. */
+	int ev_pulse;		/* The next event is a step. */
+	int flip;		/* The open cycle reverses the axis. */
+	int ev_flip;		/* The next step reverses it. */
+	int dir;		/* Of the steps described so far. */
+	int end;
+
+	/* Single motor train instead of a planner run. */
+	int jog;
+	int jog_left;		/* Constant speed steps. */
+	uint32_t jog_period;
+
+	/*
+	 * Sampled path, see pnp_stream_sampled(): for axes with an input
+	 * shaper and the resonance test.
+	 */
+	int sampled;
+	int made;		/* Steps made, signed. */
+	int k;			/* s1 is taken at k * PNP_SAMPLE_TICKS. */
+	float s0, s1;		/* Positions at the last two samples, steps. */
+	int sampled_end;
+	struct shaper *shaper;
+	int base;		/* Steps of the blocks before blk, signed. */
+	float hist[PNP_SHAPER_HIST];	/* Unshaped positions. */
+	int wave;		/* Samples of the test wave left. */
+	float wave_amp;
+	float wave_c;		/* cos() of the phase step. */
+	float wave_y0, wave_y1;	/* cos() of the last two phases. */
+
+	/* Last two path samples in blk: seconds and steps of the axis. */
+	int sample;
+	float t0, t1;
+	float p0, p1;
 };
 
 struct motor_state {
 	int chanset;	/* PWM channels. */
-	mdx_sem_t worker_sem;
 	struct move_task task;
 	const char *name;
 	void (*set_direction)(int dir);
 	int (*is_at_home)(void);
-	void (*step)(int chanset, int speed);
-	mdx_sem_t step_sem;
 	int step_nm;	/* Length of a step, nanometers. Has to be signed. */
 
+	/* Planner limits, units/s, units/s^2 and units/s^3. */
+	float max_vel;
+	float max_accel;
+	float max_jerk;
+
 	int (*cam_translate_mm_to_deg)(float z, float cam_radius, int *result);
 	int cam_radius;
 
+	/* Period tables. */
+	int axis;
+	struct shaper shaper;
+	struct stepgen sg;
+	struct pnp_stream st;
+	mdx_sem_t worker_sem;
+	int active;
+
 	/*
 	 * Current offset from home in steps.
 	 * Could be negative for Z or nozzles.
@@ -112,6 +262,25 @@ struct motor_state {
 	/* Limits. */
 	int steps_max;
 	int steps_min;
+
+	/*
+	 * Rotation axes that can turn endlessly.  Once M805 sets modular,
+	 * positions are taken modulo a turn and reached the shortest way,
+	 * the limits do not apply.
+	 */
+	int steps_revo;		/* Steps per turn, 0 if not a rotation. */
+	int modular;
+};
+
+/* Mapping of run time to real time, see PNP_HOLD_TICKS. */
+struct pnp_hold {
+	int state;
+#define	PNP_HOLD_NONE		0
+#define	PNP_HOLD_STOP		1	/* Slowing down or standing. */
+#define	PNP_HOLD_RESUME		2	/* Speeding back up. */
+	int64_t at;		/* Run time the slowdown starts at. */
+	int64_t shift;		/* Real minus run time before that. */
+	int64_t resume;		/* Real time the speedup starts at. */
 };
 
 struct pnp_state {
@@ -120,6 +289,37 @@ struct pnp_state {
 	struct motor_state motor_z;
 	struct motor_state motor_h1;
 	struct motor_state motor_h2;
+	struct motor_state *motors[PNP_NAXES];
+
+	/* Planner runs. */
+	mdx_sem_t exec_sem;
+	mdx_sem_t sync_sem;
+	int run_active;		/* Axes still playing the run. */
+	int run_error;
+	int sync_waiting;
+
+	/* Realtime commands, set from the receive interrupt. */
+	struct pnp_hold hold;
+	int abort;		/* Drop every move until pnp_abort_done(). */
+
+	float feed;		/* Path speed limit, mm/s. 0 if none. */
+
+	/*
+	 * Position the G-code asked for last, in its units, see
+	 * pnp_get_position().  G91 moves are taken from it.
+	 */
+	int pos[PNP_NAXES];
+	int relative;
+
+	/* Blended moves. */
+	int blend;
+	int safe_z;		/* Z steps, the nozzles are clear within. */
+	int safe_z_nm;		/* The same, nanometers. */
+	int last_seg;		/* Last queued block. */
+#define	PNP_SEG_NONE		0
+#define	PNP_SEG_RISE		1	/* Z only, up into the clear. */
+#define	PNP_SEG_TRAVEL		2	/* No Z, nozzles clear. */
+	int last_from[PNP_NAXES];
 };
 
 static struct pnp_state pnp;
@@ -128,40 +328,42 @@ void
 pnp_pwm_y_intr(void *arg, int irq)
 {
 
-	stm32f4_pwm_intr(arg, irq);
-	mdx_sem_post(&pnp.motor_y.step_sem);
+	stepgen_intr(&pnp.motor_y.sg);
 }
 
 void
 pnp_pwm_x_intr(void *arg, int irq)
 {
 
-	stm32f4_pwm_intr(arg, irq);
-	mdx_sem_post(&pnp.motor_x.step_sem);
+	stepgen_intr(&pnp.motor_x.sg);
+}
+
+void
+pnp_dma_y_intr(void *arg, int irq)
+{
+
+	stepgen_dma_intr(&pnp.motor_y.sg);
 }
 
 void
 pnp_pwm_z_intr(void *arg, int irq)
 {
 
-	stm32f4_pwm_intr(arg, irq);
-	mdx_sem_post(&pnp.motor_z.step_sem);
+	stepgen_intr(&pnp.motor_z.sg);
 }
 
 void
 pnp_pwm_h1_intr(void *arg, int irq)
 {
 
-	stm32f4_pwm_intr(arg, irq);
-	mdx_sem_post(&pnp.motor_h1.step_sem);
+	stepgen_intr(&pnp.motor_h1.sg);
 }
 
 void
 pnp_pwm_h2_intr(void *arg, int irq)
 {
 
-	stm32f4_pwm_intr(arg, irq);
-	mdx_sem_post(&pnp.motor_h2.step_sem);
+	stepgen_intr(&pnp.motor_h2.sg);
 }
 
 static inline int
@@ -290,388 +492,1848 @@ pnp_zset_direction(int dir)
 	pin_set(&gpio_sc, PORT_E, 3, dir); /* Z FR */
 }
 
-static void
-xstep(int chanset, int speed)
+static inline uint32_t
+pnp_ticks(float sec)
 {
-	uint32_t freq;
 
-	freq = speed * 150000;
-
-	stm32f4_pwm_step(&pwm_x_sc, chanset, freq);
+	return ((uint32_t)(sec * STEPGEN_TICK_FREQ + 0.5f));
 }
 
-static void
-ystep(int chanset, int speed)
+/* Real time of the run time t. */
+static int64_t
+pnp_hold_real(struct pnp_hold *h, int64_t t)
 {
-	uint32_t freq;
+	int64_t end;
+	float x;
+
+	if (h->state == PNP_HOLD_NONE || t <= h->at)
+		return (t + h->shift);
+
+	end = h->at + PNP_HOLD_TICKS / 2;
+	if (t < end || h->state == PNP_HOLD_STOP) {
+		if (t > end)
+			t = end;
+		x = 1.0f - 2.0f * (t - h->at) / (float)PNP_HOLD_TICKS;
+		return (h->at + h->shift + PNP_HOLD_TICKS -
+		    (int64_t)(PNP_HOLD_TICKS * sqrtf(x)));
+	}
 
-	freq = speed * 150000;
+	t -= end;
+	if (t < PNP_HOLD_TICKS / 2)
+		return (h->resume +
+		    (int64_t)sqrtf(2.0f * PNP_HOLD_TICKS * t));
 
-	stm32f4_pwm_step(&pwm_y_sc, chanset, freq);
+	return (h->resume + t + PNP_HOLD_TICKS / 2);
 }
 
+/*
+ * Take the next sample of the path of a block.  All the axes sample at
+ * the same times from the start of the block, so they share one time
+ * base and follow the straight line between the ends of the block.
+ */
 static void
-zstep(int chanset, int speed)
+pnp_stream_sample(struct pnp_stream *st, struct planner_block *b, int n)
 {
-	uint32_t freq;
+	struct profile *p;
 
-	freq = speed * 50000;
+	p = &b->profile;
 
-	stm32f4_pwm_step(&pwm_z_sc, chanset, freq);
+	st->t0 = st->t1;
+	st->p0 = st->p1;
+
+	st->sample += 1;
+	st->t1 = st->sample * PNP_SAMPLE_TIME;
+	if (st->t1 >= p->duration) {
+		st->t1 = p->duration;
+		st->p1 = n;
+	} else
+		st->p1 = n * profile_pos(p, st->t1) / b->length;
 }
 
-static void
-h1step(int chanset, int speed)
+/*
+ * Commanded position of the axis at t ticks into the run, in steps from
+ * its start.  Walks the blocks of the run, t may only grow.
+ */
+static float
+pnp_stream_path(struct motor_state *motor, int64_t t)
 {
-	uint32_t freq;
+	struct planner_block *b;
+	struct pnp_stream *st;
+	int64_t end;
+	float pos;
+	float ts;
+	int n;
+
+	st = &motor->st;
+
+	while ((b = st->blk) != NULL) {
+		end = st->blk_start + pnp_ticks(b->profile.duration);
+		if (t < end)
+			break;
+		n = b->steps[motor->axis];
+		st->base += b->dir[motor->axis] ? n : -n;
+		st->blk_start = end;
+		st->blk = planner_next(b);
+		planner_release(b, motor->axis);
+	}
+
+	if (b == NULL || t <= st->blk_start)
+		return (st->base);
 
-	freq = speed * 50000;
+	ts = (uint32_t)(t - st->blk_start) / (float)STEPGEN_TICK_FREQ;
+	pos = b->steps[motor->axis] * profile_pos(&b->profile, ts) / b->length;
 
-	stm32f4_pwm_step(&pwm_h1_sc, chanset, freq);
+	return (st->base + (b->dir[motor->axis] ? pos : -pos));
 }
 
-static void
-h2step(int chanset, int speed)
+/* Position of the axis at sample k, with the input shaper applied. */
+static float
+pnp_stream_shaped(struct motor_state *motor, int k)
 {
-	uint32_t freq;
+	struct pnp_stream *st;
+	struct shaper *sh;
+	float pos;
+	float x;
+	float f;
+	int j;
+	int i;
 
-	freq = speed * 50000;
+	st = &motor->st;
+	sh = st->shaper;
 
-	stm32f4_pwm_step(&pwm_h2_sc, chanset, freq);
-}
+	st->hist[k % PNP_SHAPER_HIST] = pnp_stream_path(motor,
+	    (int64_t)k * PNP_SAMPLE_TICKS);
 
-static int
-calc_speed(int i, int steps, int speed)
-{
-	int t;
+	if (st->blk == NULL && (int64_t)k * PNP_SAMPLE_TICKS >=
+	    st->blk_start + pnp_ticks(sh->duration) + PNP_SAMPLE_TICKS) {
+		/* Every copy of the run is over. */
+		st->sampled_end = 1;
+		return (st->base);
+	}
 
-	t = i < (steps - i) ? i : (steps - i);
-	if (t < 1000) {
-		/* Gradually increase/decrease speed */
-		speed = t / 10;
-		if (speed < 15)
-			speed = 15;
+	/* Sum up the delayed copies, the run starts from 0. */
+	pos = 0.0f;
+	for (i = 0; i < sh->n; i++) {
+		x = k - sh->t[i] / PNP_SAMPLE_TIME;
+		if (x <= 0.0f)
+			continue;
+		j = x;
+		f = x - j;
+		pos += sh->a[i] * (st->hist[j % PNP_SHAPER_HIST] * (1.0f - f) +
+		    st->hist[(j + 1) % PNP_SHAPER_HIST] * f);
 	}
 
-	return (speed);
+	return (pos);
 }
 
-static void
-pnp_worker_thread(void *arg)
+/* Position of the resonance test wave at the next sample. */
+static float
+pnp_stream_wave(struct motor_state *motor)
 {
-	struct motor_state *motor;
-	struct move_task *task;
-	uint32_t steps;
-	int speed;
-	int i;
-
-	motor = arg;
-	task = &motor->task;
-
-	while (1) {
-		mdx_sem_wait(&motor->worker_sem);
-		dprintf("%s: task rcvd\n", __func__);
-
-		steps = task->steps;
-		speed = task->speed;
-
-		dprintf("%s: steps needed %d\n", __func__, steps);
-
-		motor->set_direction(task->direction);
+	struct pnp_stream *st;
+	float y;
 
-		for (i = 0; i < steps; i++) {
-			if (task->check_home && motor->is_at_home()) {
-				task->home_found = 1;
-				break;
-			}
+	st = &motor->st;
 
-			if (task->speed_control)
-				speed = calc_speed(i, steps, speed);
+	if (--st->wave <= 0) {
+		st->sampled_end = 1;
+		return (0.0f);
+	}
 
-			motor->step(motor->chanset, speed);
-			mdx_sem_wait(&motor->step_sem);
-			if (task->direction == 1)
-				motor->steps += 1;
-			else
-				motor->steps -= 1;
-		}
+	y = 2.0f * st->wave_c * st->wave_y1 - st->wave_y0;
+	st->wave_y0 = st->wave_y1;
+	st->wave_y1 = y;
 
-		mdx_sem_post(&task->task_compl_sem);
-		dprintf("%s: task compl\n", __func__);
-	}
+	return (st->wave_amp * (1.0f - y) / 2.0f);
 }
 
+/*
+ * Next event of an axis that follows a sampled path: a step where the
+ * path crosses it, or the time of a sample, which keeps the axis from
+ * racing ahead while it is idle.  Steps go either way.
+ */
 static int
-pnp_move_nonblock(struct motor_state *motor, int new_pos)
+pnp_stream_sampled(struct motor_state *motor)
 {
-	struct move_task *task;
-	uint32_t delta;
-	int new_steps;
-	int error;
-	int tmp;
+	struct pnp_stream *st;
+	uint32_t min;
+	int64_t t;
+	float frac;
+	int target;
+	int dir;
 
-	task = &motor->task;
-	task->check_home = 0;
-	task->speed_control = 1;
+	st = &motor->st;
+
+	for (;;) {
+		if (st->s1 >= st->made + 1 || st->s1 <= st->made - 1) {
+			dir = st->s1 > st->made ? 1 : 0;
+			target = st->made + (dir ? 1 : -1);
+
+			frac = 0.0f;
+			if (st->s1 != st->s0)
+				frac = (target - st->s0) / (st->s1 - st->s0);
+			if (frac < 0.0f)
+				frac = 0.0f;
+			if (frac > 1.0f)
+				frac = 1.0f;
+			t = (int64_t)(st->k - 1) * PNP_SAMPLE_TICKS +
+			    (uint32_t)(frac * PNP_SAMPLE_TICKS);
+
+			min = PNP_MIN_TICKS;
+			if (dir != st->dir) {
+				st->dir = dir;
+				st->ev_flip = 1;
+				min += PNP_DIR_TICKS;
+			}
 
-	/* Convert required position from mm to degrees if needed. */
-	if (motor->cam_translate_mm_to_deg) {
-		if (motor->cam_radius == 0)
-			return (-1);
-		error = motor->cam_translate_mm_to_deg(new_pos,
-		    motor->cam_radius, &tmp);
-		if (error) {
-			printf("Error: can't translate coordinate\n");
-			return (-2);
+			st->made = target;
+			st->gap = t > st->open + min ? t - st->open : min;
+			st->ev_pulse = dir ? 1 : -1;
+			return (1);
 		}
-		new_pos = tmp;
-	}
-
-	new_steps = new_pos / motor->step_nm;
-	if (new_steps > motor->steps_max ||
-	    new_steps < motor->steps_min) {
-		printf("Can't move due to limits\n");
-		return (-3);
-	}
 
-	if (new_steps > motor->steps) {
-		task->direction = 1;
-		delta = abs(new_steps - motor->steps);
-	} else {
-		task->direction = 0;
-		delta = abs(motor->steps - new_steps);
-	}
+		if (st->sampled_end)
+			return (0);
 
-	task->steps = delta;
-	task->speed = 100;
+		t = (int64_t)st->k * PNP_SAMPLE_TICKS;
 
-	mdx_sem_post(&motor->worker_sem);
+		st->k += 1;
+		st->s0 = st->s1;
+		if (st->shaper != NULL)
+			st->s1 = pnp_stream_shaped(motor, st->k);
+		else
+			st->s1 = pnp_stream_wave(motor);
 
-	return (0);
+		if (t >= st->open + PNP_MIN_TICKS) {
+			st->gap = t - st->open;
+			st->ev_pulse = 0;
+			return (1);
+		}
+	}
 }
 
+/*
+ * Find the next event of the axis in the run: one of its steps, or the
+ * end of a block, so that idle axes do not race ahead of the others.
+ * Returns 0 once the run is over.
+ */
 static int
-pnp_move(struct motor_state *motor, int new_pos)
+pnp_stream_event(struct motor_state *motor)
 {
-	int error;
+	struct planner_block *b;
+	struct pnp_stream *st;
+	uint32_t min;
+	int64_t t;
+	float ts;
+	int n;
+
+	st = &motor->st;
+
+	if (st->jog_left > 0) {
+		st->jog_left -= 1;
+		st->gap = st->jog_period;
+		st->ev_pulse = motor->task.direction ? 1 : -1;
+		return (1);
+	}
 
-	error = pnp_move_nonblock(motor, new_pos);
-	if (error)
-		return (error);
+	if (st->sampled)
+		return (pnp_stream_sampled(motor));
+
+	while ((b = st->blk) != NULL) {
+		if (st->blk_done) {
+			st->blk_start += pnp_ticks(b->profile.duration);
+			st->blk = planner_next(b);
+			st->step = 0;
+			st->blk_done = 0;
+			st->sample = 0;
+			st->t1 = st->p1 = 0.0f;
+			planner_release(b, motor->axis);
+			continue;
+		}
+
+		n = b->steps[motor->axis];
+		if (st->step < n) {
+			st->step += 1;
+			while (st->p1 < st->step)
+				pnp_stream_sample(st, b, n);
+			ts = st->t0 + (st->t1 - st->t0) *
+			    (st->step - st->p0) / (st->p1 - st->p0);
+			t = st->blk_start + pnp_ticks(ts);
+
+			/*
+			 * The planner only lets an axis reverse within a run
+			 * after a block it has been idle in.
+			 */
+			min = PNP_MIN_TICKS;
+			if (b->dir[motor->axis] != st->dir) {
+				st->dir = b->dir[motor->axis];
+				st->ev_flip = 1;
+				min += PNP_DIR_TICKS;
+			}
 
-	mdx_sem_wait(&motor->task.task_compl_sem);
+			st->gap = t > st->open + min ? t - st->open : min;
+			st->ev_pulse = st->dir ? 1 : -1;
+			return (1);
+		}
+
+		st->blk_done = 1;
+		t = st->blk_start + pnp_ticks(b->profile.duration);
+		if (t >= st->open + PNP_MIN_TICKS) {
+			st->gap = t - st->open;
+			st->ev_pulse = 0;
+			return (1);
+		}
+		/* Too close to the last step, merge into the next cycle. */
+	}
 
 	return (0);
 }
 
-static void
-pnp_move_home_motor(struct motor_state *motor)
+/*
+ * Describe the next timer cycle: its length, the step it starts with
+ * (+1, -1 or 0) and whether the axis reverses before that step.  Returns
+ * 0 when the train is over.
+ */
+static int
+pnp_stream_next(struct motor_state *motor, uint32_t *ticks, int *pulse,
+    int *flip)
 {
-	struct move_task *task;
-
-	task = &motor->task;
-
-	/* First reach home quickly. */
-	if (motor->is_at_home() == 0) {
-		task->steps = PNP_MAX_Y_NM / motor->step_nm;
-		task->check_home = 1;
-		task->speed = 20;
-		task->speed_control = 0;
-		task->direction = 0;
-		mdx_sem_post(&motor->worker_sem);
-		mdx_sem_wait(&task->task_compl_sem);
+	struct pnp_stream *st;
+	struct pnp_hold hold;
+	uint32_t reserve;
+	uint32_t chunk;
+	int64_t wait;
+	int64_t real;
+	int64_t end;
+
+	st = &motor->st;
+
+	hold.state = PNP_HOLD_NONE;
+	if (pnp.hold.state != PNP_HOLD_NONE && st->jog == 0) {
+		critical_enter();
+		hold = pnp.hold;
+		critical_exit();
+	}
+	end = hold.at + PNP_HOLD_TICKS / 2;
+
+	/* Held: play idle cycles until resumed, or stop for good. */
+	if (hold.state != PNP_HOLD_NONE && st->open >= end &&
+	    (hold.state != PNP_HOLD_STOP || pnp.abort == 0)) {
+		if (hold.state == PNP_HOLD_STOP)
+			wait = PNP_IDLE_TICKS;
+		else
+			wait = hold.resume - st->real;
+		if (wait > 0) {
+			chunk = wait;
+			if (wait > 2 * PNP_IDLE_TICKS)
+				chunk = PNP_IDLE_TICKS;
+			else if (wait > PNP_IDLE_TICKS)
+				chunk = wait / 2;
+			*ticks = chunk;
+			*pulse = st->pulse;
+			*flip = st->flip;
+			st->pulse = 0;
+			st->flip = 0;
+			critical_enter();
+			st->real += chunk;
+			critical_exit();
+			return (1);
+		}
 	}
 
-	if (motor->is_at_home() == 0)
-		panic("we are still not at home");
-
-	/* Now move back a bit. */
-	task->direction = 1;
-	task->steps = 10000000 / motor->step_nm;
-	task->speed = 10;
-	task->speed_control = 0;
-	task->check_home = 0;
-	mdx_sem_post(&motor->worker_sem);
-	mdx_sem_wait(&task->task_compl_sem);
+	if ((hold.state == PNP_HOLD_STOP && pnp.abort && st->open >= end) ||
+	    (st->gap == 0 && pnp_stream_event(motor) == 0)) {
+		if (st->end)
+			return (0);
+		/* Close the cycle of the last step. */
+		st->end = 1;
+		*ticks = STEPGEN_STOP_TICKS;
+		*pulse = st->pulse;
+		*flip = st->flip;
+		st->pulse = 0;
+		st->flip = 0;
+		return (1);
+	}
 
-	if (motor->is_at_home())
-		panic("still at home");
+	/* A reversal needs a last idle cycle of its own. */
+	reserve = st->ev_flip ? PNP_DIR_TICKS : 0;
 
-	/* Now try to reach home slowly. */
+	chunk = st->gap - reserve;
+	if (chunk == 0)
+		chunk = reserve;
+	else if (chunk > PNP_IDLE_TICKS) {
+		chunk = PNP_IDLE_TICKS;
+		if (st->gap - reserve - chunk < PNP_MIN_TICKS)
+			chunk = (st->gap - reserve) / 2;
+	}
 
-	printf("%s is trying to reach home\n", motor->name);
-	task->steps = PNP_MAX_Y_NM / motor->step_nm;
-	task->check_home = 1;
-	task->speed = 2;
-	task->speed_control = 0;
-	task->direction = 0;
-	mdx_sem_post(&motor->worker_sem);
-	mdx_sem_wait(&task->task_compl_sem);
+	/* The slowdown ends with a cycle. */
+	if (hold.state != PNP_HOLD_NONE && st->open < end &&
+	    st->open + chunk > end)
+		chunk = end - st->open;
 
-	/* Now go into home for 1 mm. */
+	real = chunk;
+	if (hold.state != PNP_HOLD_NONE) {
+		real = pnp_hold_real(&hold, st->open + chunk) - st->real;
+		if (real < chunk)
+			real = chunk;
+	}
 
-	printf("%s is going into home for 1mm\n", motor->name);
-	task->steps = 1000000 / motor->step_nm;
-	task->check_home = 0;
-	task->speed = 2;
-	task->speed_control = 0;
-	task->direction = 0;
-	mdx_sem_post(&motor->worker_sem);
-	mdx_sem_wait(&task->task_compl_sem);
+	*ticks = real;
+	*pulse = st->pulse;
+	*flip = st->flip;
+
+	st->pulse = 0;
+	st->flip = 0;
+	critical_enter();
+	st->open += chunk;
+	st->real += real;
+	critical_exit();
+	st->gap -= chunk;
+	if (st->gap == 0) {
+		st->pulse = st->ev_pulse;
+		st->flip = st->ev_flip;
+		st->ev_flip = 0;
+	}
 
-	motor->steps = 0;
-	printf("%s home reached\n", motor->name);
+	return (1);
 }
 
-static int
-pnp_move_home_z(struct motor_state *motor)
+/*
+ * Fill one half of the period table with the next cycles of the run.
+ * Runs in thread context, away from the step timing.
+ */
+static void
+pnp_stream_fill(struct motor_state *motor, int half)
 {
 	struct move_task *task;
-	int found;
+	struct stepgen *sg;
+	uint32_t ticks;
 	int steps;
-	int dir;
+	int pulse;
+	int flip;
+	int stop;
+	int idx;
 	int i;
 
 	task = &motor->task;
+	sg = &motor->sg;
 
-	/* First leave home. */
-	if (pnp_is_z_home()) {
-		task->steps = 200;
-		task->check_home = 0;
-		task->speed = 15;
-		task->speed_control = 0;
-		task->home_found = 0;
-		task->direction = 1;
-		mdx_sem_post(&motor->worker_sem);
-		mdx_sem_wait(&task->task_compl_sem);
-		/* TODO: ensure we left it. */
-	}
-
-	steps = 100;
-	dir = 1;
-	found = 0;
+	steps = 0;
+	stop = -1;
 
-	/* Now find home once again. */
-	for (i = 0; i < 20; i++) {
-		printf("Making %d steps towards %d\n", steps, dir);
-		task->direction = dir;
-		task->steps = steps;
-		task->check_home = 1;
-		task->speed = 15;
-		task->speed_control = 0;
-		task->home_found = 0;
-		mdx_sem_post(&motor->worker_sem);
-		mdx_sem_wait(&task->task_compl_sem);
-		if (task->home_found) {
-			found = 1;
+	for (i = 0; i < STEPGEN_HALF; i++) {
+		idx = half * STEPGEN_HALF + i;
+		if (pnp_stream_next(motor, &ticks, &pulse, &flip) == 0) {
+			stepgen_put(sg, idx, STEPGEN_STOP_TICKS, 0);
+			stop = idx;
+			task->fill_done = 1;
 			break;
 		}
-		steps += 200;
-		dir = !dir;
+
+		stepgen_put(sg, idx, ticks, pulse != 0);
+		if (flip)
+			stepgen_put_dir(sg, idx, pulse > 0);
+		steps += pulse;
 	}
 
-	if (found == 0) {
-		printf("Error: Z Home not found\n");
-		return (-1);
+	stepgen_ready(sg, half, steps, stop);
+}
+
+static void
+pnp_stream_refill(struct motor_state *motor)
+{
+	struct move_task *task;
+
+	task = &motor->task;
+
+	while (task->fill_done == 0 &&
+	    motor->sg.ready[task->fill_half] == 0) {
+		pnp_stream_fill(motor, task->fill_half);
+		task->fill_half = !task->fill_half;
 	}
+}
 
-	/* Now make 50 steps into home. */
-	task->steps = 50;
-	task->check_home = 0;
-	task->speed = 15;
-	task->speed_control = 0;
-	task->home_found = 0;
-	task->direction = dir;
-	mdx_sem_post(&motor->worker_sem);
-	mdx_sem_wait(&task->task_compl_sem);
+static void
+pnp_stream_update(void *arg, int steps)
+{
+	struct motor_state *motor;
 
-	motor->steps = 0;
-	printf("Z home found\n");
+	motor = arg;
+	motor->steps += steps;
 
-	return (0);
+	if (motor->task.fill_done == 0)
+		mdx_sem_post(&motor->worker_sem);
 }
 
-static int
-pnp_move_home(void)
+/* Called from the update interrupt when the axis reverses within a run. */
+static void
+pnp_stream_dir(void *arg, int dir)
 {
-	int error;
+	struct motor_state *motor;
 
-	error = pnp_move_home_z(&pnp.motor_z);
-	if (error)
-		return (error);
+	motor = arg;
+	motor->task.direction = dir;
+	motor->set_direction(dir);
+}
 
-	pnp_move_home_motor(&pnp.motor_y);
-	pnp_move_home_motor(&pnp.motor_x);
+static void
+pnp_stream_done(void *arg, int error)
+{
+	struct motor_state *motor;
 
-	return (0);
+	motor = arg;
+	motor->task.error = error;
+	motor->task.stream = 0;
+	mdx_sem_post(&motor->worker_sem);
 }
 
-void
-pnp_command_move(struct gcode_command *cmd)
+/*
+ * The train of this axis is over.  Let go of the blocks it has not read
+ * (only after an underrun) and tell the executor.
+ */
+static void
+pnp_stream_finish(struct motor_state *motor)
 {
-	uint32_t x, y, z, h1, h2;
+	struct planner_block *b;
+	struct pnp_stream *st;
 
-	/* TODO: check for errors. */
+	st = &motor->st;
 
-	if (cmd->x_set) {
-		x = cmd->x;
-		printf("moving X to %d\n", x);
-		pnp_move_nonblock(&pnp.motor_x, x);
+	while ((b = st->blk) != NULL) {
+		st->blk = planner_next(b);
+		planner_release(b, motor->axis);
 	}
 
-	if (cmd->y_set) {
-		y = cmd->y;
-		printf("moving Y to %d\n", y);
-		pnp_move_nonblock(&pnp.motor_y, y);
+	if (motor->task.error) {
+		lprintf(LOG_ERR, "%s: step table underrun, position lost\n",
+		    motor->name);
+		pnp.run_error = 1;
 	}
 
-	if (cmd->h1_set) {
-		h1 = -1 * cmd->h1;
-		printf("moving H1 to %d\n", h1);
-		pnp_move_nonblock(&pnp.motor_h1, h1);
-	}
+	motor->active = 0;
 
-	if (cmd->h2_set) {
-		h2 = -1 * cmd->h2;
-		printf("moving H2 to %d\n", h2);
-		/* TODO: check for errors. */
-		pnp_move_nonblock(&pnp.motor_h2, h2);
+	if (st->jog) {
+		mdx_sem_post(&motor->task.task_compl_sem);
+		return;
 	}
 
-	if (cmd->h1_set)
-		mdx_sem_wait(&pnp.motor_h1.task.task_compl_sem);
-	if (cmd->h2_set)
-		mdx_sem_wait(&pnp.motor_h2.task.task_compl_sem);
-	if (cmd->x_set)
-		mdx_sem_wait(&pnp.motor_x.task.task_compl_sem);
-	if (cmd->y_set)
-		mdx_sem_wait(&pnp.motor_y.task.task_compl_sem);
+	critical_enter();
+	pnp.run_active -= 1;
+	critical_exit();
 
-	if (cmd->z_set) {
-		z = cmd->z;
-		printf("moving Z to %d\n", z);
-		pnp_move(&pnp.motor_z, z);
-	}
+	mdx_sem_post(&pnp.exec_sem);
 }
 
 static void
-pnp_motor_initialize(struct motor_state *motor, const char *name)
+pnp_worker_thread(void *arg)
 {
+	struct motor_state *motor;
 
-	mdx_sem_init(&motor->worker_sem, 0);
-	mdx_sem_init(&motor->step_sem, 0);
-	motor->name = name;
+	motor = arg;
+
+	while (1) {
+		mdx_sem_wait(&motor->worker_sem);
+		if (motor->task.stream)
+			pnp_stream_refill(motor);
+		else if (motor->active)
+			pnp_stream_finish(motor);
+	}
 }
 
+/* Called from the update interrupt while a homing move looks for home. */
 static int
-pnp_thread_create(const char *name, void *arg)
+pnp_stream_check(void *arg)
+{
+	struct motor_state *motor;
+
+	motor = arg;
+
+	if (motor->is_at_home()) {
+		motor->task.home_found = 1;
+		return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * Play the task of the motor at a constant speed and wait for it.  Only
+ * used while nothing runs from the planner.
+ */
+static void
+pnp_task_run(struct motor_state *motor)
+{
+	struct move_task *task;
+	float sps;
+
+	task = &motor->task;
+
+	if (task->steps == 0)
+		return;
+
+	motor->set_direction(task->direction);
+
+	sps = task->speed * 1000000.0f / motor->step_nm;
+
+	bzero(&motor->st, sizeof(struct pnp_stream));
+	motor->st.jog = 1;
+	motor->st.jog_left = task->steps;
+	motor->st.jog_period = STEPGEN_TICK_FREQ / sps;
+	motor->sg.check = task->check_home ? pnp_stream_check : NULL;
+	motor->active = 1;
+
+	task->home_found = 0;
+	task->error = 0;
+	task->fill_half = 0;
+	task->fill_done = 0;
+	task->stream = 1;
+
+	pnp_stream_refill(motor);
+	stepgen_prepare(&motor->sg);
+	stepgen_enable(&motor->sg);
+
+	mdx_sem_wait(&task->task_compl_sem);
+	motor->sg.check = NULL;
+}
+
+/*
+ * Shake the motor about its position: amp steps up and back down, freq
+ * times a second, for the given number of periods.  The direction pin
+ * changes twice a period, so the train is fed from the interrupt.
+ */
+static void
+pnp_wave_run(struct motor_state *motor, int freq, float amp, int periods)
+{
+	struct move_task *task;
+	float x2;
+
+	task = &motor->task;
+
+	/* Square of the phase step, which is well below 1 radian. */
+	x2 = 2.0f * 3.14159265f * freq * PNP_SAMPLE_TIME;
+	x2 *= x2;
+
+	bzero(&motor->st, sizeof(struct pnp_stream));
+	motor->st.jog = 1;
+	motor->st.sampled = 1;
+	motor->st.dir = task->direction;
+	motor->st.wave = periods / (freq * PNP_SAMPLE_TIME) + 1;
+	motor->st.wave_amp = amp;
+	motor->st.wave_c = 1.0f - x2 / 2.0f + x2 * x2 / 24.0f -
+	    x2 * x2 * x2 / 720.0f;
+	motor->st.wave_y0 = motor->st.wave_c;
+	motor->st.wave_y1 = 1.0f;
+	motor->sg.intr = 1;
+	motor->active = 1;
+
+	task->error = 0;
+	task->fill_half = 0;
+	task->fill_done = 0;
+	task->stream = 1;
+
+	pnp_stream_refill(motor);
+	stepgen_prepare(&motor->sg);
+	stepgen_enable(&motor->sg);
+
+	mdx_sem_wait(&task->task_compl_sem);
+	motor->sg.intr = 0;
+}
+
+/*
+ * Start playing a run of planner blocks.  Every axis gets its own step
+ * train over the same timeline, idle ones just play empty cycles, so
+ * blocks queued later can still join the run.
+ */
+static void
+pnp_run_start(void)
+{
+	struct planner_block *b;
+	struct motor_state *motor;
+	struct move_task *task;
+	uint32_t lag;
+	int dir;
+	int i;
+
+	/* A hold that came in while idle keeps the run from starting. */
+	critical_enter();
+	if (pnp.hold.state == PNP_HOLD_STOP) {
+		critical_exit();
+		return;
+	}
+	bzero(&pnp.hold, sizeof(struct pnp_hold));
+	for (i = 0; i < PNP_NAXES; i++) {
+		pnp.motors[i]->st.open = 0;
+		pnp.motors[i]->st.real = 0;
+	}
+	pnp.run_active = PNP_NAXES;
+	critical_exit();
+
+	b = planner_begin();
+	if (b == NULL) {
+		pnp.run_active = 0;
+		return;
+	}
+
+	/*
+	 * Shaped axes lag behind by the mean delay of their shaper.  Hold
+	 * the other axes back by as much, so they all stay in step.
+	 */
+	lag = 0;
+	for (i = 0; i < PNP_NAXES; i++)
+		if (pnp_ticks(pnp.motors[i]->shaper.centroid) > lag)
+			lag = pnp_ticks(pnp.motors[i]->shaper.centroid);
+
+	for (i = 0; i < PNP_NAXES; i++) {
+		motor = pnp.motors[i];
+		task = &motor->task;
+
+		dir = planner_run_dir(i);
+		if (dir >= 0) {
+			task->direction = dir;
+			motor->set_direction(dir);
+		}
+
+		bzero(&motor->st, sizeof(struct pnp_stream));
+		motor->st.blk = b;
+		motor->st.blk_start = lag - pnp_ticks(motor->shaper.centroid);
+		motor->st.dir = task->direction;
+		if (motor->shaper.type != SHAPER_NONE) {
+			motor->st.sampled = 1;
+			motor->st.shaper = &motor->shaper;
+		}
+		motor->active = 1;
+
+		task->error = 0;
+		task->fill_half = 0;
+		task->fill_done = 0;
+		task->stream = 1;
+
+		pnp_stream_refill(motor);
+	}
+
+	/* Start the counters back to back, they share the run time base. */
+	for (i = 0; i < PNP_NAXES; i++)
+		stepgen_prepare(&pnp.motors[i]->sg);
+	critical_enter();
+	for (i = 0; i < PNP_NAXES; i++)
+		stepgen_enable(&pnp.motors[i]->sg);
+	critical_exit();
+}
+
+/*
+ * After an abort, between runs: drop what is still queued and take the
+ * positions the motors stopped at.
+ */
+static void
+pnp_flush(void)
+{
+	struct motor_state *motor;
+	int i;
+
+	planner_flush();
+
+	for (i = 0; i < PNP_NAXES; i++) {
+		motor = pnp.motors[i];
+		planner_set_position(motor->axis, motor->steps);
+	}
+
+	pnp.last_seg = PNP_SEG_NONE;
+
+	critical_enter();
+	bzero(&pnp.hold, sizeof(struct pnp_hold));
+	critical_exit();
+
+	/* The moves asked for are gone, go on from where the motors are. */
+	pnp_get_position(pnp.pos);
+}
+
+/* Furthest any axis has got with its step table, in run and real time. */
+static void
+pnp_hold_ahead(int64_t *open, int64_t *real)
+{
+	struct pnp_stream *st;
+	int i;
+
+	*open = 0;
+	*real = 0;
+
+	for (i = 0; i < PNP_NAXES; i++) {
+		st = &pnp.motors[i]->st;
+		if (st->open > *open)
+			*open = st->open;
+		if (st->real > *real)
+			*real = st->real;
+	}
+}
+
+/*
+ * Realtime feed hold, called from the receive interrupt.  The axes may
+ * be computing a cycle of up to PNP_IDLE_TICKS from where they are, so
+ * the slowdown starts right after that.
+ */
+void
+pnp_hold(void)
+{
+	struct pnp_hold *h;
+	int64_t open;
+	int64_t real;
+
+	h = &pnp.hold;
+
+	critical_enter();
+
+	if (h->state == PNP_HOLD_STOP) {
+		critical_exit();
+		return;
+	}
+
+	if (pnp.run_active == 0) {
+		bzero(h, sizeof(struct pnp_hold));
+		h->state = PNP_HOLD_STOP;
+		critical_exit();
+		return;
+	}
+
+	pnp_hold_ahead(&open, &real);
+	open += PNP_IDLE_TICKS;
+
+	if (h->state == PNP_HOLD_RESUME) {
+		/* Let the last speedup finish, it is linear after that. */
+		if (open < h->at + PNP_HOLD_TICKS)
+			open = h->at + PNP_HOLD_TICKS;
+		h->shift = h->resume - h->at;
+	}
+
+	h->at = open;
+	h->state = PNP_HOLD_STOP;
+
+	critical_exit();
+}
+
+/* Realtime resume, from the receive interrupt. */
+void
+pnp_resume(void)
+{
+	struct pnp_hold *h;
+	int64_t open;
+	int64_t real;
+
+	h = &pnp.hold;
+
+	critical_enter();
+
+	if (h->state != PNP_HOLD_STOP || pnp.abort) {
+		critical_exit();
+		return;
+	}
+
+	if (pnp.run_active == 0) {
+		h->state = PNP_HOLD_NONE;
+		critical_exit();
+		mdx_sem_post(&pnp.exec_sem);
+		return;
+	}
+
+	/* All the axes are standing by then. */
+	pnp_hold_ahead(&open, &real);
+	if (real < h->at + h->shift + PNP_HOLD_TICKS)
+		real = h->at + h->shift + PNP_HOLD_TICKS;
+
+	h->resume = real + PNP_IDLE_TICKS;
+	h->state = PNP_HOLD_RESUME;
+
+	critical_exit();
+}
+
+/*
+ * Realtime quick stop, from the receive interrupt.  The run slows down
+ * as on a hold and ends there, everything queued is dropped.  Moves are
+ * ignored until the caller has flushed its own queue.
+ */
+void
+pnp_abort(void)
+{
+
+	pnp.abort = 1;
+	pnp_hold();
+	mdx_sem_post(&pnp.exec_sem);
+}
+
+void
+pnp_abort_done(void)
+{
+
+	pnp.abort = 0;
+}
+
+int
+pnp_get_state(void)
+{
+
+	if (pnp.abort || pnp.hold.state == PNP_HOLD_STOP)
+		return (PNP_STATE_HOLD);
+
+	if (pnp.run_active || planner_count() > 0)
+		return (PNP_STATE_RUN);
+
+	return (PNP_STATE_IDLE);
+}
+
+/* Mask of the axes playing a step table, by PNP_AXIS_*. */
+int
+pnp_get_busy(void)
+{
+	int busy;
+	int i;
+
+	busy = 0;
+	for (i = 0; i < PNP_NAXES; i++)
+		if (pnp.motors[i]->active)
+			busy |= (1 << i);
+
+	return (busy);
+}
+
+/* Moves planned and not done yet. */
+int
+pnp_get_queued(void)
+{
+
+	return (planner_count());
+}
+
+/*
+ * Where the motors are, as counted from the step tables played: X, Y
+ * and Z in nanometers, heads in micro degrees, in the G-code directions.
+ */
+void
+pnp_get_position(int *pos)
+{
+	struct motor_state *motor;
+	int steps;
+	int i;
+
+	for (i = 0; i < PNP_NAXES; i++) {
+		motor = pnp.motors[i];
+		steps = motor->steps;
+		if (motor->modular) {
+			steps %= motor->steps_revo;
+			if (steps > motor->steps_revo / 2)
+				steps -= motor->steps_revo;
+			else if (steps <= -motor->steps_revo / 2)
+				steps += motor->steps_revo;
+		}
+		pos[i] = steps * motor->step_nm;
+	}
+
+	/* See pnp_command_move(). */
+	pos[PNP_AXIS_H1] = -pos[PNP_AXIS_H1];
+	pos[PNP_AXIS_H2] = -pos[PNP_AXIS_H2];
+
+	motor = &pnp.motor_z;
+	pos[PNP_AXIS_Z] = trig_position_z(pos[PNP_AXIS_Z] / 1000000.0f,
+	    motor->cam_radius);
+}
+
+static void
+pnp_exec_thread(void *arg)
+{
+
+	while (1) {
+		mdx_sem_wait(&pnp.exec_sem);
+
+		if (pnp.run_active)
+			continue;
+
+		if (pnp.abort) {
+			pnp_flush();
+			if (pnp.sync_waiting) {
+				pnp.sync_waiting = 0;
+				mdx_sem_post(&pnp.sync_sem);
+			}
+			continue;
+		}
+
+		if (planner_count() == 0) {
+			if (pnp.sync_waiting) {
+				pnp.sync_waiting = 0;
+				mdx_sem_post(&pnp.sync_sem);
+			}
+			continue;
+		}
+
+		/* Give the next move a chance to be planned in. */
+		if (pnp.sync_waiting == 0 && planner_count() == 1)
+			mdx_usleep(PNP_START_DELAY);
+
+		pnp_run_start();
+	}
+}
+
+/* Wait until every queued move is done. */
+int
+pnp_sync(void)
+{
+
+	pnp.sync_waiting = 1;
+	mdx_sem_post(&pnp.exec_sem);
+	mdx_sem_wait(&pnp.sync_sem);
+
+	if (pnp.run_error) {
+		pnp.run_error = 0;
+		return (-1);
+	}
+
+	return (0);
+}
+
+static int
+pnp_queue_feed(const int *target, float feed, int flags)
+{
+	int error;
+
+	if (pnp.abort)
+		return (0);
+
+	error = planner_add(target, feed, flags);
+	mdx_sem_post(&pnp.exec_sem);
+
+	pnp.last_seg = PNP_SEG_NONE;
+
+	return (error);
+}
+
+static int
+pnp_queue(const int *target, int flags)
+{
+
+	return (pnp_queue_feed(target, pnp.feed, flags));
+}
+
+/* The planner position after all queued moves. */
+static void
+pnp_get_target(int *target)
+{
+	int i;
+
+	for (i = 0; i < PNP_NAXES; i++)
+		target[i] = planner_get_position(i);
+}
+
+static void
+pnp_set_position(struct motor_state *motor, int steps)
+{
+
+	motor->steps = steps;
+	planner_set_position(motor->axis, steps);
+}
+
+/*
+ * Convert a position in nanometers (or micro degrees) into the step
+ * position of the motor.
+ */
+static int
+pnp_pos_to_steps(struct motor_state *motor, int new_pos, int *result)
+{
+	int new_steps;
+	int delta;
+	int error;
+	int cur;
+	int tmp;
+
+	/* Convert required position from mm to degrees if needed. */
+	if (motor->cam_translate_mm_to_deg) {
+		if (motor->cam_radius == 0)
+			return (-1);
+		error = motor->cam_translate_mm_to_deg(new_pos,
+		    motor->cam_radius, &tmp);
+		if (error) {
+			lprintf(LOG_ERR, "Error: can't translate coordinate\n");
+			return (-2);
+		}
+		new_pos = tmp;
+	}
+
+	new_steps = new_pos / motor->step_nm;
+
+	if (motor->modular) {
+		cur = planner_get_position(motor->axis);
+		delta = (new_steps - cur) % motor->steps_revo;
+		if (delta > motor->steps_revo / 2)
+			delta -= motor->steps_revo;
+		else if (delta <= -motor->steps_revo / 2)
+			delta += motor->steps_revo;
+		*result = cur + delta;
+		return (0);
+	}
+
+	if (new_steps > motor->steps_max ||
+	    new_steps < motor->steps_min) {
+		lprintf(LOG_ERR, "Can't move due to limits\n");
+		return (-3);
+	}
+
+	*result = new_steps;
+
+	return (0);
+}
+
+static int
+pnp_move_nonblock(struct motor_state *motor, int new_pos)
+{
+	int target[PNP_NAXES];
+	int error;
+
+	pnp_get_target(target);
+
+	error = pnp_pos_to_steps(motor, new_pos, &target[motor->axis]);
+	if (error)
+		return (error);
+
+	return (pnp_queue(target, 0));
+}
+
+static int
+pnp_move(struct motor_state *motor, int new_pos)
+{
+	int error;
+
+	error = pnp_move_nonblock(motor, new_pos);
+	if (error)
+		return (error);
+
+	return (pnp_sync());
+}
+
+static void
+pnp_move_home_motor(struct motor_state *motor)
+{
+	struct move_task *task;
+
+	task = &motor->task;
+
+	/* First reach home quickly. */
+	if (motor->is_at_home() == 0) {
+		task->steps = PNP_MAX_Y_NM / motor->step_nm;
+		task->check_home = 1;
+		task->speed = PNP_HOME_FAST;
+		task->direction = 0;
+		pnp_task_run(motor);
+	}
+
+	if (motor->is_at_home() == 0)
+		panic("we are still not at home");
+
+	/* Now move back a bit. */
+	task->direction = 1;
+	task->steps = 10000000 / motor->step_nm;
+	task->speed = PNP_HOME_BACKOFF;
+	task->check_home = 0;
+	pnp_task_run(motor);
+
+	if (motor->is_at_home())
+		panic("still at home");
+
+	/* Now try to reach home slowly. */
+
+	lprintf(LOG_INFO, "%s is trying to reach home\n", motor->name);
+	task->steps = PNP_MAX_Y_NM / motor->step_nm;
+	task->check_home = 1;
+	task->speed = PNP_HOME_SLOW;
+	task->direction = 0;
+	pnp_task_run(motor);
+
+	/* Now go into home for 1 mm. */
+
+	lprintf(LOG_INFO, "%s is going into home for 1mm\n", motor->name);
+	task->steps = 1000000 / motor->step_nm;
+	task->check_home = 0;
+	task->speed = PNP_HOME_SLOW;
+	task->direction = 0;
+	pnp_task_run(motor);
+
+	pnp_set_position(motor, 0);
+	lprintf(LOG_INFO, "%s home reached\n", motor->name);
+}
+
+static int
+pnp_move_home_z(struct motor_state *motor)
+{
+	struct move_task *task;
+	int found;
+	int steps;
+	int dir;
+	int i;
+
+	task = &motor->task;
+
+	/* First leave home. */
+	if (pnp_is_z_home()) {
+		task->steps = 200;
+		task->check_home = 0;
+		task->speed = PNP_HOME_Z;
+		task->home_found = 0;
+		task->direction = 1;
+		pnp_task_run(motor);
+		/* TODO: ensure we left it. */
+	}
+
+	steps = 100;
+	dir = 1;
+	found = 0;
+
+	/* Now find home once again. */
+	for (i = 0; i < 20; i++) {
+		lprintf(LOG_DEBUG, "Making %d steps towards %d\n", steps, dir);
+		task->direction = dir;
+		task->steps = steps;
+		task->check_home = 1;
+		task->speed = PNP_HOME_Z;
+		task->home_found = 0;
+		pnp_task_run(motor);
+		if (task->home_found) {
+			found = 1;
+			break;
+		}
+		steps += 200;
+		dir = !dir;
+	}
+
+	if (found == 0) {
+		lprintf(LOG_ERR, "Error: Z Home not found\n");
+		return (-1);
+	}
+
+	/* Now make 50 steps into home. */
+	task->steps = 50;
+	task->check_home = 0;
+	task->speed = PNP_HOME_Z;
+	task->home_found = 0;
+	task->direction = dir;
+	pnp_task_run(motor);
+
+	pnp_set_position(motor, 0);
+	lprintf(LOG_INFO, "Z home found\n");
+
+	return (0);
+}
+
+static int
+pnp_move_home(void)
+{
+	int error;
+
+	error = pnp_move_home_z(&pnp.motor_z);
+	if (error)
+		return (error);
+
+	pnp_move_home_motor(&pnp.motor_y);
+	pnp_move_home_motor(&pnp.motor_x);
+
+	return (0);
+}
+
+static int
+pnp_z_clear(int z)
+{
+
+	return (abs(z) <= pnp.safe_z);
+}
+
+/*
+ * Fraction of the travel from a to b that Z may overlap with, so that
+ * the overlap is PNP_BLEND_MM long at most and never more than half.
+ */
+static float
+pnp_blend_frac(const int *a, const int *b)
+{
+	float dx, dy;
+	float len;
+
+	dx = (b[PNP_AXIS_X] - a[PNP_AXIS_X]) * PNP_XY_STEP_NM / 1000000.0f;
+	dy = (b[PNP_AXIS_Y] - a[PNP_AXIS_Y]) * PNP_XY_STEP_NM / 1000000.0f;
+	len = sqrtf(dx * dx + dy * dy);
+	if (len <= PNP_BLEND_MM * 2)
+		return (0.5f);
+
+	return (PNP_BLEND_MM / len);
+}
+
+/* The point frac of the way from a to b, with Z at z. */
+static void
+pnp_blend_point(const int *a, const int *b, float frac, int z, int *result)
+{
+	int i;
+
+	for (i = 0; i < PNP_NAXES; i++)
+		result[i] = a[i] + (int)((b[i] - a[i]) * frac);
+	result[PNP_AXIS_Z] = z;
+}
+
+/*
+ * Z speed, degrees/s, that keeps the nozzle within PNP_Z_LAND_VEL between
+ * the two Z step positions.  The cam is the slowest at the end further
+ * from its middle.
+ */
+static float
+pnp_land_feed(int from, int to)
+{
+	float r0, r1;
+	float feed;
+
+	r0 = trig_rate_z(from * (PNP_Z_STEP_DEG / 1000000.0f), CAM_RADIUS);
+	r1 = trig_rate_z(to * (PNP_Z_STEP_DEG / 1000000.0f), CAM_RADIUS);
+	if (r0 == 0.0f || r1 == 0.0f)
+		return (pnp.feed);
+
+	/* Degrees per nanometer, into degrees per mm. */
+	feed = PNP_Z_LAND_VEL * (r0 > r1 ? r0 : r1) * 1000000.0f;
+	if (pnp.feed > 0.0f && pnp.feed < feed)
+		feed = pnp.feed;
+
+	return (feed);
+}
+
+/*
+ * Queue a move of Z alone to z nanometers, at target in steps.  Going
+ * down, the stroke is split so that the last of it lands at
+ * PNP_Z_LAND_VEL.
+ */
+static int
+pnp_queue_land(const int *target, int z, int flags)
+{
+	int mid[PNP_NAXES];
+	int cur[PNP_NAXES];
+	int zc, zt;
+	int steps;
+	int land;
+
+	pnp_get_target(cur);
+
+	zc = cur[PNP_AXIS_Z];
+	zt = target[PNP_AXIS_Z];
+
+	if (abs(zt) <= abs(zc) || (zc != 0 && (zt > 0) != (zc > 0)))
+		return (pnp_queue(target, flags));
+
+	if (abs(z) > PNP_Z_LAND_NM) {
+		land = z > 0 ? z - PNP_Z_LAND_NM : z + PNP_Z_LAND_NM;
+		if (pnp_pos_to_steps(&pnp.motor_z, land, &steps) == 0 &&
+		    abs(steps) > abs(zc)) {
+			memcpy(mid, target, sizeof(mid));
+			mid[PNP_AXIS_Z] = steps;
+			pnp_queue(mid, flags);
+			flags = 0;
+			zc = steps;
+		}
+	}
+
+	return (pnp_queue_feed(target, pnp_land_feed(zc, zt), flags));
+}
+
+/*
+ * Queue a move of everything but Z.  If Z is still rising into the
+ * clear, let the rest of the rise run along the start of the travel.
+ */
+static void
+pnp_queue_travel(const int *target)
+{
+	int from[PNP_NAXES];
+	int head[PNP_NAXES];
+	int cur[PNP_NAXES];
+	int z;
+
+	pnp_get_target(cur);
+
+	memcpy(from, cur, sizeof(from));
+
+	if (pnp.blend && pnp.last_seg == PNP_SEG_RISE) {
+		z = cur[PNP_AXIS_Z];
+		cur[PNP_AXIS_Z] = pnp.last_from[PNP_AXIS_Z] > 0 ?
+		    pnp.safe_z : -pnp.safe_z;
+		if (cur[PNP_AXIS_Z] != z && planner_cut(cur) == 0) {
+			pnp_blend_point(cur, target,
+			    pnp_blend_frac(cur, target), z, head);
+			pnp_queue(head, 0);
+			memcpy(from, head, sizeof(from));
+		}
+	}
+
+	pnp_queue(target, 0);
+
+	if (pnp_z_clear(target[PNP_AXIS_Z])) {
+		pnp.last_seg = PNP_SEG_TRAVEL;
+		memcpy(pnp.last_from, from, sizeof(from));
+	}
+}
+
+/*
+ * Queue a move of Z alone.  Lowering out of the clear right after a
+ * travel starts over the end of it, a rise out of the low area is
+ * remembered so that the next travel can start before it is over.
+ */
+static void
+pnp_queue_z(const int *target, int z)
+{
+	int tail[PNP_NAXES];
+	int cur[PNP_NAXES];
+	int zc, zt;
+
+	pnp_get_target(cur);
+
+	zc = cur[PNP_AXIS_Z];
+	zt = target[PNP_AXIS_Z];
+
+	if (pnp.blend && pnp.last_seg == PNP_SEG_TRAVEL &&
+	    pnp_z_clear(zc) && !pnp_z_clear(zt)) {
+		pnp_blend_point(cur, pnp.last_from,
+		    pnp_blend_frac(pnp.last_from, cur), zc, tail);
+		cur[PNP_AXIS_Z] = zt > 0 ? pnp.safe_z : -pnp.safe_z;
+		if (cur[PNP_AXIS_Z] != zc && planner_cut(tail) == 0)
+			pnp_queue(cur, 0);
+		cur[PNP_AXIS_Z] = zc;
+	}
+
+	pnp_queue_land(target, z, 0);
+
+	if (!pnp_z_clear(zc) && pnp_z_clear(zt) &&
+	    (zt == 0 || (zt > 0) == (zc > 0))) {
+		pnp.last_seg = PNP_SEG_RISE;
+		memcpy(pnp.last_from, cur, sizeof(cur));
+	}
+}
+
+/*
+ * Select how the angle of a rotation axis is reached: modulo a turn the
+ * shortest way, or within its limits as given.  Going back to limits,
+ * whole turns made so far are dropped from the position, so that the
+ * angle is within them again.
+ */
+int
+pnp_set_modular(int axis, int modular)
+{
+	struct motor_state *motor;
+	int pos[PNP_NAXES];
+	int steps;
+
+	if (axis < 0 || axis >= PNP_NAXES)
+		return (-1);
+
+	motor = pnp.motors[axis];
+	if (modular && motor->steps_revo == 0)
+		return (-1);
+
+	if (modular == motor->modular)
+		return (0);
+
+	pnp_sync();
+
+	if (modular == 0) {
+		steps = motor->steps % motor->steps_revo;
+		if (steps > motor->steps_revo / 2)
+			steps -= motor->steps_revo;
+		else if (steps <= -motor->steps_revo / 2)
+			steps += motor->steps_revo;
+		pnp_set_position(motor, steps);
+		pnp_get_position(pos);
+		pnp.pos[axis] = pos[axis];
+	}
+
+	motor->modular = modular;
+
+	return (0);
+}
+
+int
+pnp_get_modular(int axis)
+{
+
+	return (pnp.motors[axis]->modular);
+}
+
+/*
+ * Set the input shaper of the X or Y axis, SHAPER_NONE to turn it off.
+ * Waits for the queued moves, the shaper is taken at the start of a run.
+ */
+int
+pnp_set_shaper(int axis, int type, float freq, float damping)
+{
+	struct motor_state *motor;
+	struct shaper shaper;
+	int error;
+
+	if (axis != PNP_AXIS_X && axis != PNP_AXIS_Y)
+		return (-1);
+
+	error = shaper_init(&shaper, type, freq, damping);
+	if (error)
+		return (error);
+
+	if (shaper.duration >= (PNP_SHAPER_HIST - 2) * PNP_SAMPLE_TIME) {
+		lprintf(LOG_ERR, "%s: %d Hz is too low\n", __func__, (int)freq);
+		return (-2);
+	}
+
+	pnp_sync();
+
+	motor = pnp.motors[axis];
+	motor->shaper = shaper;
+
+	/*
+	 * Delayed copies of a reversal would overlap, shaped axes stop
+	 * before they reverse.
+	 */
+	planner_set_reversible(axis, motor->sg.dma_base == 0 &&
+	    type == SHAPER_NONE);
+
+	return (0);
+}
+
+/* The input shaper of the X or Y axis, as last set. */
+int
+pnp_get_shaper(int axis, int *type, float *freq, float *damping)
+{
+	struct shaper *shaper;
+
+	if (axis != PNP_AXIS_X && axis != PNP_AXIS_Y)
+		return (-1);
+
+	shaper = &pnp.motors[axis]->shaper;
+	*type = shaper->type;
+	*freq = shaper->freq;
+	*damping = shaper->damping;
+
+	return (0);
+}
+
+/*
+ * Enable blended moves with the nozzles clear within safe_z of the top,
+ * nanometers of Z.  The cam makes this a Z angle that has to be
+ * translated.  Disabled, every move stops and waits for the last one,
+ * as G0 always did.  Moves queued already are played as planned.
+ */
+int
+pnp_set_blend(int enable, int safe_z)
+{
+	int error;
+	int steps;
+
+	if (safe_z < 0)
+		return (-1);
+
+	error = pnp_pos_to_steps(&pnp.motor_z, safe_z, &steps);
+	if (error)
+		return (error);
+
+	pnp.safe_z = abs(steps);
+	pnp.safe_z_nm = safe_z;
+	pnp.blend = enable;
+	pnp.last_seg = PNP_SEG_NONE;
+
+	return (0);
+}
+
+void
+pnp_get_blend(int *enable, int *safe_z)
+{
+
+	*enable = pnp.blend;
+	*safe_z = pnp.safe_z_nm;
+}
+
+/*
+ * The position of the axis to move to, in the G-code units: val itself,
+ * or added to the last one after G91.
+ */
+static int
+pnp_command_pos(int axis, int val, int *result)
+{
+	struct motor_state *motor;
+	int64_t pos;
+
+	if (pnp.relative == 0) {
+		*result = val;
+		return (0);
+	}
+
+	pos = (int64_t)pnp.pos[axis] + val;
+
+	/* Heads can turn on endlessly. */
+	motor = pnp.motors[axis];
+	if (motor->modular)
+		pos %= (int64_t)motor->steps_revo * motor->step_nm;
+
+	if (pos != (int)pos) {
+		lprintf(LOG_ERR, "Can't move due to limits\n");
+		return (-1);
+	}
+
+	*result = pos;
+
+	return (0);
+}
+
+/*
+ * X, Y and the nozzles move together as one planner block, Z follows.
+ * Without blending Z starts from a standstill once they are done and the
+ * command only returns when all of it is over.  Blended moves are left
+ * to run, whatever needs the machine to stand still has to pnp_sync().
+ * Returns -1 if the move can't be made, or failed while waited for.
+ */
+int
+pnp_command_move(struct gcode_command *cmd)
+{
+	int target[PNP_NAXES];
+	int pos[PNP_NAXES];
+	int error;
+
+	pnp_get_target(target);
+
+	/* Modal, as OpenPnP only sends it when the speed changes. */
+	if (cmd->feed_set)
+		pnp.feed = cmd->feed / 60.0f;
+
+	memcpy(pos, pnp.pos, sizeof(pos));
+
+	error = 0;
+
+	if (cmd->x_set) {
+		error |= pnp_command_pos(PNP_AXIS_X, cmd->x, &pos[PNP_AXIS_X]);
+		lprintf(LOG_INFO, "moving X to %d\n", pos[PNP_AXIS_X]);
+		error |= pnp_pos_to_steps(&pnp.motor_x, pos[PNP_AXIS_X],
+		    &target[PNP_AXIS_X]);
+	}
+
+	if (cmd->y_set) {
+		error |= pnp_command_pos(PNP_AXIS_Y, cmd->y, &pos[PNP_AXIS_Y]);
+		lprintf(LOG_INFO, "moving Y to %d\n", pos[PNP_AXIS_Y]);
+		error |= pnp_pos_to_steps(&pnp.motor_y, pos[PNP_AXIS_Y],
+		    &target[PNP_AXIS_Y]);
+	}
+
+	if (cmd->h1_set) {
+		error |= pnp_command_pos(PNP_AXIS_H1, cmd->h1,
+		    &pos[PNP_AXIS_H1]);
+		lprintf(LOG_INFO, "moving H1 to %d\n", -pos[PNP_AXIS_H1]);
+		error |= pnp_pos_to_steps(&pnp.motor_h1, -pos[PNP_AXIS_H1],
+		    &target[PNP_AXIS_H1]);
+	}
+
+	if (cmd->h2_set) {
+		error |= pnp_command_pos(PNP_AXIS_H2, cmd->h2,
+		    &pos[PNP_AXIS_H2]);
+		lprintf(LOG_INFO, "moving H2 to %d\n", -pos[PNP_AXIS_H2]);
+		error |= pnp_pos_to_steps(&pnp.motor_h2, -pos[PNP_AXIS_H2],
+		    &target[PNP_AXIS_H2]);
+	}
+
+	if (cmd->z_set) {
+		error |= pnp_command_pos(PNP_AXIS_Z, cmd->z, &pos[PNP_AXIS_Z]);
+		lprintf(LOG_INFO, "moving Z to %d\n", pos[PNP_AXIS_Z]);
+	}
+
+	if (error)
+		return (-1);
+
+	if (pnp.blend == 0) {
+		pnp_queue(target, 0);
+		if (cmd->z_set) {
+			error = pnp_pos_to_steps(&pnp.motor_z, pos[PNP_AXIS_Z],
+			    &target[PNP_AXIS_Z]);
+			if (error == 0)
+				pnp_queue_land(target, pos[PNP_AXIS_Z],
+				    PLANNER_F_STOP);
+			else
+				pos[PNP_AXIS_Z] = pnp.pos[PNP_AXIS_Z];
+		}
+		/* Dropped by an abort, see pnp_flush(). */
+		if (pnp.abort == 0)
+			memcpy(pnp.pos, pos, sizeof(pos));
+		if (pnp_sync() != 0)
+			error = -1;
+		return (error);
+	}
+
+	if (cmd->x_set || cmd->y_set || cmd->h1_set || cmd->h2_set)
+		pnp_queue_travel(target);
+
+	if (cmd->z_set) {
+		error = pnp_pos_to_steps(&pnp.motor_z, pos[PNP_AXIS_Z],
+		    &target[PNP_AXIS_Z]);
+		if (error == 0)
+			pnp_queue_z(target, pos[PNP_AXIS_Z]);
+		else
+			pos[PNP_AXIS_Z] = pnp.pos[PNP_AXIS_Z];
+	}
+
+	if (pnp.abort == 0)
+		memcpy(pnp.pos, pos, sizeof(pos));
+
+	return (error);
+}
+
+/* G90 or G91: positions are absolute, or relative to the last one. */
+void
+pnp_set_relative(int relative)
+{
+
+	pnp.relative = relative;
+}
+
+/* Hand the step length and limits of the motor to the planner. */
+static void
+pnp_motor_update(struct motor_state *motor)
+{
+
+	planner_set_axis(motor->axis, motor->step_nm / 1000000.0f,
+	    motor->max_vel, motor->max_accel, motor->max_jerk);
+}
+
+static void
+pnp_motor_limits(struct motor_state *motor, float max_vel, float max_accel,
+    float max_jerk)
+{
+
+	motor->max_vel = max_vel;
+	motor->max_accel = max_accel;
+	motor->max_jerk = max_jerk;
+	pnp_motor_update(motor);
+}
+
+/*
+ * M203: top speed of the axis, units/s: mm for X and Y, degrees of the
+ * cam for Z and degrees for the heads.  Taken by the moves queued after.
+ */
+int
+pnp_set_max_vel(int axis, float max_vel)
+{
+	struct motor_state *motor;
+
+	if (axis < 0 || axis >= PNP_NAXES || max_vel <= 0.0f)
+		return (-1);
+
+	motor = pnp.motors[axis];
+	motor->max_vel = max_vel;
+	pnp_motor_update(motor);
+
+	return (0);
+}
+
+/* M204: acceleration of the axis, units/s^2. */
+int
+pnp_set_max_accel(int axis, float max_accel)
+{
+	struct motor_state *motor;
+
+	if (axis < 0 || axis >= PNP_NAXES || max_accel <= 0.0f)
+		return (-1);
+
+	motor = pnp.motors[axis];
+	motor->max_accel = max_accel;
+	pnp_motor_update(motor);
+
+	return (0);
+}
+
+/*
+ * M92: steps per unit of the axis, for another microstepping of the
+ * driver.  The position and the limits are kept where they are in
+ * units, so the machine has to stand still.
+ */
+int
+pnp_set_steps_per_unit(int axis, float steps)
+{
+	struct motor_state *motor;
+	int step_nm;
+	int old;
+
+	if (axis < 0 || axis >= PNP_NAXES || steps <= 0.0f)
+		return (-1);
+
+	step_nm = 1000000.0f / steps + 0.5f;
+	if (step_nm <= 0)
+		return (-1);
+
+	pnp_sync();
+
+	motor = pnp.motors[axis];
+	old = motor->step_nm;
+	motor->step_nm = step_nm;
+	motor->steps_min = (int64_t)motor->steps_min * old / step_nm;
+	motor->steps_max = (int64_t)motor->steps_max * old / step_nm;
+	if (motor->steps_revo)
+		motor->steps_revo = (int64_t)motor->steps_revo * old / step_nm;
+	pnp_set_position(motor, (int64_t)motor->steps * old / step_nm);
+	pnp_motor_update(motor);
+
+	if (axis == PNP_AXIS_Z)
+		pnp.safe_z = (int64_t)pnp.safe_z * old / step_nm;
+
+	return (0);
+}
+
+/*
+ * M205 J: how far the path may be off a corner, mm, which sets the
+ * speed it is taken at.  Taken by the moves queued after.
+ */
+int
+pnp_set_junction_deviation(float mm)
+{
+
+	if (mm < 0.0f)
+		return (-1);
+
+	planner_set_junction_deviation(mm);
+
+	return (0);
+}
+
+float
+pnp_get_junction_deviation(void)
+{
+
+	return (planner_get_junction_deviation());
+}
+
+/* Steps per unit, top speed and acceleration of the axis, see above. */
+void
+pnp_get_limits(int axis, float *steps, float *max_vel, float *max_accel)
+{
+	struct motor_state *motor;
+
+	motor = pnp.motors[axis];
+	*steps = 1000000.0f / motor->step_nm;
+	*max_vel = motor->max_vel;
+	*max_accel = motor->max_accel;
+}
+
+static void
+pnp_motor_initialize(struct motor_state *motor, const char *name, int axis)
+{
+
+	motor->name = name;
+	motor->axis = axis;
+	pnp.motors[axis] = motor;
+}
+
+static int
+pnp_stream_initialize(struct motor_state *motor, uint32_t base)
 {
 	struct thread *td;
 
-	td = mdx_thread_create(name, 1 /* prio */, 500 /* quantum */,
-	    8192 /* stack */, pnp_worker_thread, arg);
+	stepgen_init(&motor->sg, base, motor->chanset);
+	motor->sg.update = pnp_stream_update;
+	motor->sg.done = pnp_stream_done;
+	motor->sg.set_dir = pnp_stream_dir;
+	motor->sg.arg = motor;
+	mdx_sem_init(&motor->worker_sem, 0);
+
+	td = mdx_thread_create(motor->name, 1 /* prio */, 500 /* quantum */,
+	    4096 /* stack */, pnp_worker_thread, motor);
 	if (td == NULL) {
-		printf("%s: Failed to create X mover thread\n", __func__);
+		printf("%s: Failed to create %s refill thread\n", __func__,
+		    motor->name);
 		return (-1);
 	}
 
@@ -683,34 +2345,33 @@ pnp_thread_create(const char *name, void *arg)
 static int
 pnp_initialize(void)
 {
+	struct thread *td;
 	int error;
+	int i;
 
 	bzero(&pnp, sizeof(struct pnp_state));
 
-	pnp_motor_initialize(&pnp.motor_x, "X Motor");
+	pnp_motor_initialize(&pnp.motor_x, "X Motor", PNP_AXIS_X);
 	pnp.motor_x.step_nm = PNP_XY_STEP_NM;
 	pnp.motor_x.set_direction = pnp_xset_direction;
-	pnp.motor_x.step = xstep;
 	pnp.motor_x.chanset = (1 << 0);
 	pnp.motor_x.is_at_home = pnp_is_x_home;
 	pnp.motor_x.steps_min = PNP_STEPS_X_MIN;
 	pnp.motor_x.steps_max = PNP_STEPS_X_MAX;
 	mdx_sem_init(&pnp.motor_x.task.task_compl_sem, 0);
 
-	pnp_motor_initialize(&pnp.motor_y, "Y Motor");
+	pnp_motor_initialize(&pnp.motor_y, "Y Motor", PNP_AXIS_Y);
 	pnp.motor_y.step_nm = PNP_XY_STEP_NM;
 	pnp.motor_y.set_direction = pnp_yset_direction;
-	pnp.motor_y.step = ystep;
 	pnp.motor_y.chanset = ((1 << 0) | (1 << 1));
 	pnp.motor_y.is_at_home = pnp_is_yl_home;
 	pnp.motor_y.steps_min = PNP_STEPS_Y_MIN;
 	pnp.motor_y.steps_max = PNP_STEPS_Y_MAX;
 	mdx_sem_init(&pnp.motor_y.task.task_compl_sem, 0);
 
-	pnp_motor_initialize(&pnp.motor_z, "Z Motor");
+	pnp_motor_initialize(&pnp.motor_z, "Z Motor", PNP_AXIS_Z);
 	pnp.motor_z.step_nm = PNP_Z_STEP_DEG;
 	pnp.motor_z.set_direction = pnp_zset_direction;
-	pnp.motor_z.step = zstep;
 	pnp.motor_z.chanset = (1 << 0);
 	pnp.motor_z.is_at_home = pnp_is_z_home;
 	pnp.motor_z.cam_translate_mm_to_deg = trig_translate_z;
@@ -719,55 +2380,86 @@ pnp_initialize(void)
 	pnp.motor_z.steps_max = PNP_STEPS_Z_MAX;
 	mdx_sem_init(&pnp.motor_z.task.task_compl_sem, 0);
 
-	pnp_motor_initialize(&pnp.motor_h1, "H1 Motor");
+	pnp_motor_initialize(&pnp.motor_h1, "H1 Motor", PNP_AXIS_H1);
 	pnp.motor_h1.step_nm = PNP_NR_STEP_DEG;
 	pnp.motor_h1.set_direction = pnp_h1set_direction;
-	pnp.motor_h1.step = h1step;
 	pnp.motor_h1.chanset = (1 << 0);
 	pnp.motor_h1.is_at_home = NULL;
 	pnp.motor_h1.steps_min = PNP_STEPS_H_MIN;
 	pnp.motor_h1.steps_max = PNP_STEPS_H_MAX;
+	pnp.motor_h1.steps_revo = PNP_NR_FULL_REVO_STEPS;
 	mdx_sem_init(&pnp.motor_h1.task.task_compl_sem, 0);
 
-	pnp_motor_initialize(&pnp.motor_h2, "H2 Motor");
+	pnp_motor_initialize(&pnp.motor_h2, "H2 Motor", PNP_AXIS_H2);
 	pnp.motor_h2.step_nm = PNP_NR_STEP_DEG;
 	pnp.motor_h2.set_direction = pnp_h2set_direction;
-	pnp.motor_h2.step = h2step;
 	pnp.motor_h2.chanset = (1 << 0);
 	pnp.motor_h2.is_at_home = NULL;
 	pnp.motor_h2.steps_min = PNP_STEPS_H_MIN;
 	pnp.motor_h2.steps_max = PNP_STEPS_H_MAX;
+	pnp.motor_h2.steps_revo = PNP_NR_FULL_REVO_STEPS;
 	mdx_sem_init(&pnp.motor_h2.task.task_compl_sem, 0);
 
-	error = pnp_thread_create("X Motor", &pnp.motor_x);
-	if (error) {
-		printf("%s: Failed to create X mover thread\n", __func__);
-		return (-1);
-	}
+	planner_init();
+	pnp_motor_limits(&pnp.motor_x, PNP_XY_MAX_VEL, PNP_XY_MAX_ACCEL,
+	    PNP_XY_MAX_JERK);
+	pnp_motor_limits(&pnp.motor_y, PNP_XY_MAX_VEL, PNP_XY_MAX_ACCEL,
+	    PNP_XY_MAX_JERK);
+	pnp_motor_limits(&pnp.motor_z, PNP_Z_MAX_VEL, PNP_Z_MAX_ACCEL,
+	    PNP_Z_MAX_JERK);
+	pnp_motor_limits(&pnp.motor_h1, PNP_NR_MAX_VEL, PNP_NR_MAX_ACCEL,
+	    PNP_NR_MAX_JERK);
+	pnp_motor_limits(&pnp.motor_h2, PNP_NR_MAX_VEL, PNP_NR_MAX_ACCEL,
+	    PNP_NR_MAX_JERK);
 
-	error = pnp_thread_create("Y Motor", &pnp.motor_y);
-	if (error) {
-		printf("%s: Failed to create Y mover thread\n", __func__);
-		return (-1);
-	}
+	/*
+	 * Planned moves are played from period tables.  TIM4 (Y) has an
+	 * update DMA request (DMA1 Stream 6 Channel 2); the other motor
+	 * timers have none, so they reload the periods from their update
+	 * interrupt instead.
+	 */
+	error = pnp_stream_initialize(&pnp.motor_x, TIM10_BASE);
+	if (error)
+		return (error);
 
-	error = pnp_thread_create("Z Motor", &pnp.motor_z);
-	if (error) {
-		printf("%s: Failed to create Z mover thread\n", __func__);
-		return (-1);
-	}
+	error = pnp_stream_initialize(&pnp.motor_y, TIM4_BASE);
+	if (error)
+		return (error);
+	stepgen_init_dma(&pnp.motor_y.sg, DMA1_BASE, 6, 2);
 
-	error = pnp_thread_create("H1 Motor", &pnp.motor_h1);
-	if (error) {
-		printf("%s: Failed to create H1 mover thread\n", __func__);
-		return (-1);
+	error = pnp_stream_initialize(&pnp.motor_z, TIM14_BASE);
+	if (error)
+		return (error);
+
+	error = pnp_stream_initialize(&pnp.motor_h1, TIM13_BASE);
+	if (error)
+		return (error);
+
+	error = pnp_stream_initialize(&pnp.motor_h2, TIM12_BASE);
+	if (error)
+		return (error);
+
+	/* Timers fed from the interrupt can reverse in the middle of a run. */
+	for (i = 0; i < PNP_NAXES; i++) {
+		shaper_init(&pnp.motors[i]->shaper, SHAPER_NONE, 0.0f,
+		    PNP_SHAPER_DAMPING);
+		planner_set_reversible(i, pnp.motors[i]->sg.dma_base == 0);
 	}
 
-	error = pnp_thread_create("H2 Motor", &pnp.motor_h2);
-	if (error) {
-		printf("%s: Failed to create H2 mover thread\n", __func__);
+	error = pnp_set_blend(1, PNP_SAFE_Z_NM);
+	if (error)
+		return (error);
+
+	mdx_sem_init(&pnp.exec_sem, 0);
+	mdx_sem_init(&pnp.sync_sem, 0);
+
+	td = mdx_thread_create("planner", 1 /* prio */, 500 /* quantum */,
+	    4096 /* stack */, pnp_exec_thread, NULL);
+	if (td == NULL) {
+		printf("%s: Failed to create planner thread\n", __func__);
 		return (-1);
 	}
+	mdx_sched_add(td);
 
 	pnp_xenable(1);
 	pnp_yenable(1);
@@ -812,15 +2504,53 @@ pnp_test_heads(void)
 static int
 pnp_move_xy(uint32_t new_pos_x, uint32_t new_pos_y)
 {
+	int target[PNP_NAXES];
+	int error;
+
+	pnp_get_target(target);
+
+	error = pnp_pos_to_steps(&pnp.motor_x, new_pos_x, &target[PNP_AXIS_X]);
+	if (error == 0)
+		error = pnp_pos_to_steps(&pnp.motor_y, new_pos_y,
+		    &target[PNP_AXIS_Y]);
+	if (error)
+		return (error);
+
+	pnp_queue(target, 0);
+	error = pnp_sync();
+
+	dprintf("%s: new pos %d %d\n", __func__, pnp.motor_x.steps,
+	    pnp.motor_y.steps);
+
+	return (error);
+}
+
+/*
+ * G28: home Z, Y and X, and move 0,0 to the far Y end.  The heads have
+ * no home switch, they stay where they are.
+ */
+int
+pnp_home(void)
+{
+	int error;
 
-	pnp_move_nonblock(&pnp.motor_x, new_pos_x);
-	pnp_move_nonblock(&pnp.motor_y, new_pos_y);
+	pnp_sync();
+
+	/* Homing goes by the motor directions, not the G-code ones. */
+	pnp.motor_y.set_direction = pnp_yset_direction;
+
+	error = pnp_move_home();
+	if (error)
+		return (error);
 
-	mdx_sem_wait(&pnp.motor_x.task.task_compl_sem);
-	mdx_sem_wait(&pnp.motor_y.task.task_compl_sem);
+	/* Change location of 0,0. */
+	error = pnp_move_xy(0, PNP_MAX_Y_NM);
+	if (error)
+		return (error);
+	pnp_set_position(&pnp.motor_y, 0);
+	pnp.motor_y.set_direction = pnp_yset_direction_rev;
 
-	dprintf("%s: new pos %d %d\n", __func__, pnp.motor_x.pos,
-	    pnp.motor_y.pos);
+	pnp_get_position(pnp.pos);
 
 	return (0);
 }
@@ -845,6 +2575,58 @@ pnp_move_random(void)
 	pnp_move_xy(0, 0);
 }
 
+/* Steps the resonance test shakes the motor by at freq Hz. */
+static float
+pnp_resonance_amp(struct motor_state *motor, int freq)
+{
+	float amp;
+	float w;
+
+	/* The wave peaks at amp * w^2 / 2. */
+	w = 2.0f * 3.14159265f * freq;
+	amp = 2.0f * PNP_RES_ACCEL / (w * w);
+
+	return (amp * 1000000.0f / motor->step_nm);
+}
+
+/*
+ * M958: shake the X or Y axis over a sweep of frequencies, at the same
+ * peak acceleration each, to find the resonance for its input shaper:
+ * the head rings and the camera picture blurs the most at it.  The
+ * axis shakes about where it stands, the lowest frequency the furthest.
+ */
+int
+pnp_test_resonance(int axis)
+{
+	struct motor_state *motor;
+	float amp;
+	int reach;
+	int freq;
+
+	if (axis != PNP_AXIS_X && axis != PNP_AXIS_Y)
+		return (-1);
+
+	pnp_sync();
+
+	motor = pnp.motors[axis];
+	reach = pnp_resonance_amp(motor, PNP_RES_FREQ_MIN) + 1;
+	if (motor->steps - reach < motor->steps_min ||
+	    motor->steps + reach > motor->steps_max) {
+		lprintf(LOG_ERR, "%s: too close to the end\n", motor->name);
+		return (-1);
+	}
+
+	for (freq = PNP_RES_FREQ_MIN; freq <= PNP_RES_FREQ_MAX &&
+	    pnp.abort == 0; freq += PNP_RES_FREQ_STEP) {
+		amp = pnp_resonance_amp(motor, freq);
+		printf("%s: %d Hz, %d steps\n", motor->name, freq, (int)amp);
+		pnp_wave_run(motor, freq, amp, PNP_RES_PERIODS);
+		mdx_usleep(PNP_RES_PAUSE);
+	}
+
+	return (0);
+}
+
 static int
 pnp_test_z(void)
 {
@@ -872,18 +2654,15 @@ pnp_main(void)
 	int error;
 
 	pnp_initialize();
-	pnp_test_heads();
 	if (1 == 0)
 		pnp_test_z();
 
-	error = pnp_move_home();
+	/* Everything planned from now on starts from home. */
+	error = pnp_home();
 	if (error)
 		return (error);
 
-	/* Change location of 0,0. */
-	pnp_move_xy(0, PNP_MAX_Y_NM);
-	pnp.motor_y.steps = 0;
-	pnp.motor_y.set_direction = pnp_yset_direction_rev;
+	pnp_test_heads();
 
 	if (1 == 0)
 		pnp_move_random();
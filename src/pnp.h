@@ -27,14 +27,51 @@
 #ifndef _SRC_PNP_H_
 #define	_SRC_PNP_H_
 
+#define	PNP_AXIS_X		0
+#define	PNP_AXIS_Y		1
+#define	PNP_AXIS_Z		2
+#define	PNP_AXIS_H1		3
+#define	PNP_AXIS_H2		4
+#define	PNP_NAXES		5
+
+#define	PNP_STATE_IDLE		0
+#define	PNP_STATE_RUN		1
+#define	PNP_STATE_HOLD		2	/* Held or aborted. */
+
 void pnp_pwm_x_intr(void *arg, int irq);
 void pnp_pwm_y_intr(void *arg, int irq);
+void pnp_dma_y_intr(void *arg, int irq);
 void pnp_pwm_z_intr(void *arg, int irq);
 void pnp_pwm_h1_intr(void *arg, int irq);
 void pnp_pwm_h2_intr(void *arg, int irq);
 
 int pnp_main(void);
-void pnp_command_move(struct gcode_command *cmd);
+int pnp_command_move(struct gcode_command *cmd);
+void pnp_set_relative(int relative);
+int pnp_home(void);
+int pnp_set_max_vel(int axis, float max_vel);
+int pnp_set_max_accel(int axis, float max_accel);
+int pnp_set_steps_per_unit(int axis, float steps);
+int pnp_set_junction_deviation(float mm);
+float pnp_get_junction_deviation(void);
+void pnp_get_limits(int axis, float *steps, float *max_vel,
+    float *max_accel);
+int pnp_set_blend(int enable, int safe_z);
+void pnp_get_blend(int *enable, int *safe_z);
+int pnp_sync(void);
+int pnp_set_shaper(int axis, int type, float freq, float damping);
+int pnp_get_shaper(int axis, int *type, float *freq, float *damping);
+int pnp_test_resonance(int axis);
+int pnp_set_modular(int axis, int modular);
+int pnp_get_modular(int axis);
 void pnp_henable(int enable);
+void pnp_hold(void);
+void pnp_resume(void);
+void pnp_abort(void);
+void pnp_abort_done(void);
+int pnp_get_state(void);
+void pnp_get_position(int *pos);
+int pnp_get_busy(void);
+int pnp_get_queued(void);
 
 #endif /* !_SRC_PNP_H_ */
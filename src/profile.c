@@ -0,0 +1,203 @@
+/*-
+ * Copyright (c) 2024 Ruslan Bukin <br@bsdpad.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Jerk-limited (S-curve) velocity profiles.
+ *
+ * A move is a ramp from the entry speed up to the peak speed, a cruise
+ * and a ramp down to the exit speed: up to seven segments of constant
+ * jerk.  Moves too short to reach the maximum speed get the highest
+ * peak speed that still fits, ramps too small to reach the maximum
+ * acceleration get a lower peak acceleration, so the profile is exact
+ * in both cases.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/systm.h>
+
+#include <lib/msun/src/math.h>
+
+#include "profile.h"
+
+/* Bisection steps when searching for a speed. */
+#define	PROFILE_SEARCH_ITER	24
+
+/* Distance covered while changing speed from v0 to v1. */
+float
+profile_ramp_dist(float v0, float v1, float accel, float jerk)
+{
+	float dv;
+	float t;
+
+	dv = fabsf(v1 - v0);
+	if (dv * jerk >= accel * accel)
+		t = dv / accel + accel / jerk;
+	else
+		t = 2.0f * sqrtf(dv / jerk);
+
+	return (0.5f * (v0 + v1) * t);
+}
+
+/* Highest speed reachable from v0 (or v0 reachable from) over dist. */
+float
+profile_reach(float v0, float dist, float accel, float jerk)
+{
+	float hi, lo, mid;
+	int i;
+
+	lo = v0;
+
+	/* Without the jerk limit the speed could not get any higher. */
+	hi = sqrtf(v0 * v0 + 2.0f * accel * dist);
+
+	for (i = 0; i < PROFILE_SEARCH_ITER; i++) {
+		mid = 0.5f * (lo + hi);
+		if (profile_ramp_dist(v0, mid, accel, jerk) <= dist)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+static void
+profile_ramp_init(struct profile_ramp *r, float v0, float v1, float accel,
+    float jerk)
+{
+	float dv;
+	float sign;
+	float a;
+
+	dv = fabsf(v1 - v0);
+	sign = v1 >= v0 ? 1.0f : -1.0f;
+
+	if (dv * jerk >= accel * accel) {
+		a = accel;
+		r->tj = accel / jerk;
+		r->ta = dv / accel - r->tj;
+	} else {
+		a = sqrtf(dv * jerk);
+		r->tj = a / jerk;
+		r->ta = 0.0f;
+	}
+
+	r->v0 = v0;
+	r->v1 = v1;
+	r->jerk = sign * jerk;
+	r->accel = sign * a;
+	r->duration = 2.0f * r->tj + r->ta;
+	r->dist = 0.5f * (v0 + v1) * r->duration;
+
+	r->v_1 = v0 + r->jerk * r->tj * r->tj / 2.0f;
+	r->s_1 = v0 * r->tj + r->jerk * r->tj * r->tj * r->tj / 6.0f;
+	r->v_2 = r->v_1 + r->accel * r->ta;
+	r->s_2 = r->s_1 + r->v_1 * r->ta + r->accel * r->ta * r->ta / 2.0f;
+}
+
+/* Distance covered t seconds into a ramp. */
+static float
+profile_ramp_pos(struct profile_ramp *r, float t)
+{
+	float tau;
+
+	if (t < r->tj)
+		return (r->v0 * t + r->jerk * t * t * t / 6.0f);
+
+	if (t < r->tj + r->ta) {
+		tau = t - r->tj;
+		return (r->s_1 + r->v_1 * tau + r->accel * tau * tau / 2.0f);
+	}
+
+	tau = t - r->tj - r->ta;
+	if (tau > r->tj)
+		tau = r->tj;
+
+	return (r->s_2 + r->v_2 * tau + r->accel * tau * tau / 2.0f -
+	    r->jerk * tau * tau * tau / 6.0f);
+}
+
+/*
+ * Plan a move of the given length from speed v0 to v1, cruising at no
+ * more than vmax.  v0 and v1 have to be reachable from each other within
+ * the length.
+ */
+void
+profile_plan(struct profile *p, float length, float v0, float v1,
+    float vmax, float accel, float jerk)
+{
+	float hi, lo, mid;
+	int i;
+
+	p->length = length;
+
+	if (profile_ramp_dist(v0, vmax, accel, jerk) +
+	    profile_ramp_dist(vmax, v1, accel, jerk) <= length)
+		p->peak = vmax;
+	else {
+		/* Short move, find the peak speed that fits. */
+		lo = v0 > v1 ? v0 : v1;
+		hi = vmax;
+		for (i = 0; i < PROFILE_SEARCH_ITER; i++) {
+			mid = 0.5f * (lo + hi);
+			if (profile_ramp_dist(v0, mid, accel, jerk) +
+			    profile_ramp_dist(mid, v1, accel, jerk) <= length)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		p->peak = lo;
+	}
+
+	profile_ramp_init(&p->up, v0, p->peak, accel, jerk);
+	profile_ramp_init(&p->down, p->peak, v1, accel, jerk);
+
+	p->cruise_dist = length - p->up.dist - p->down.dist;
+	if (p->cruise_dist < 0.0f || p->peak <= 0.0f)
+		p->cruise_dist = 0.0f;
+	p->cruise_time = p->peak > 0.0f ? p->cruise_dist / p->peak : 0.0f;
+
+	p->duration = p->up.duration + p->cruise_time + p->down.duration;
+}
+
+/* Distance covered t seconds into the move. */
+float
+profile_pos(struct profile *p, float t)
+{
+
+	if (t <= p->up.duration)
+		return (profile_ramp_pos(&p->up, t));
+
+	t -= p->up.duration;
+	if (t <= p->cruise_time)
+		return (p->up.dist + p->peak * t);
+
+	t -= p->cruise_time;
+	if (t > p->down.duration)
+		t = p->down.duration;
+
+	return (p->up.dist + p->cruise_dist + profile_ramp_pos(&p->down, t));
+}
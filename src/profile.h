@@ -0,0 +1,69 @@
+/*-
+ * Copyright (c) 2024 Ruslan Bukin <br@bsdpad.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SRC_PROFILE_H_
+#define	_SRC_PROFILE_H_
+
+/*
+ * Jerk-limited change of speed from v0 to v1: jerk, optional constant
+ * acceleration, jerk back to zero acceleration.  The acceleration is
+ * symmetric in time, so the distance covered is (v0 + v1) / 2 * duration.
+ */
+struct profile_ramp {
+	float v0;
+	float v1;
+	float jerk;		/* Signed. */
+	float accel;		/* Signed peak acceleration. */
+	float tj;		/* Each jerk phase. */
+	float ta;		/* Constant acceleration phase. */
+	float duration;
+	float dist;
+
+	/* Speed and distance at the end of the first two phases. */
+	float v_1;
+	float s_1;
+	float v_2;
+	float s_2;
+};
+
+/* 7-segment move: ramp up, cruise, ramp down. */
+struct profile {
+	struct profile_ramp up;
+	struct profile_ramp down;
+	float peak;
+	float cruise_time;
+	float cruise_dist;
+	float length;
+	float duration;
+};
+
+float profile_ramp_dist(float v0, float v1, float accel, float jerk);
+float profile_reach(float v0, float dist, float accel, float jerk);
+void profile_plan(struct profile *p, float length, float v0, float v1,
+    float vmax, float accel, float jerk);
+float profile_pos(struct profile *p, float t);
+
+#endif /* !_SRC_PROFILE_H_ */
@@ -0,0 +1,221 @@
+/*-
+ * Copyright (c) 2024 Ruslan Bukin <br@bsdpad.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Component present inputs of the heads, S1 and S2.  They are sampled
+ * every SENSOR_POLL and a change only counts once the input has stayed
+ * there for SENSOR_DEBOUNCE samples.  Changes are pushed to the host
+ * while it has asked for them, see M802.  Printing may have to wait for
+ * the console, so the sampler queues them for a thread of their own.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/systm.h>
+#include <sys/sem.h>
+#include <sys/thread.h>
+
+#include <arm/stm/stm32f4.h>
+
+#include "board.h"
+#include "gcode.h"
+#include "sensor.h"
+
+#define	SENSOR_POLL		1000	/* us */
+#define	SENSOR_DEBOUNCE		5	/* samples */
+#define	SENSOR_QUEUE		16	/* events */
+
+struct sensor {
+	int port;
+	int pin;
+	int state;		/* Debounced, 1 if a component is held. */
+	int count;		/* Samples the input differed for. */
+};
+
+static struct sensor sensors[SENSOR_COUNT] = {
+	{ PORT_B, 3 },		/* S1 */
+	{ PORT_D, 4 },		/* S2 */
+};
+
+struct sensor_event {
+	int sensor;
+	int val;
+	uint32_t ms;
+};
+
+/* Events waiting to be pushed, one is kept empty. */
+static struct sensor_event sensor_queue[SENSOR_QUEUE];
+static int sensor_head;
+static int sensor_tail;
+static mdx_sem_t sensor_sem;
+
+static int sensor_events;
+static uint64_t sensor_us;	/* Since power up, under critical_enter(). */
+
+/* The inputs are low while there is a component. */
+static int
+sensor_sample(struct sensor *s)
+{
+
+	return (pin_get(&gpio_sc, s->port, s->pin) ? 0 : 1);
+}
+
+/*
+ * Queue a change of sensor i, stamped with the time now.  Changes that
+ * come faster than they are printed are dropped, the state is still
+ * there for M105 and the status report.
+ */
+static void
+sensor_push(int i, int val)
+{
+	struct sensor_event *ev;
+	int next;
+
+	critical_enter();
+	next = (sensor_head + 1) % SENSOR_QUEUE;
+	if (next == sensor_tail) {
+		critical_exit();
+		return;
+	}
+	ev = &sensor_queue[sensor_head];
+	ev->sensor = i + 1;
+	ev->val = val;
+	ev->ms = sensor_us / 1000;
+	sensor_head = next;
+	critical_exit();
+
+	mdx_sem_post(&sensor_sem);
+}
+
+/* Print the changes queued. */
+static void
+sensor_event_thread(void *arg)
+{
+	struct sensor_event ev;
+
+	while (1) {
+		mdx_sem_wait(&sensor_sem);
+
+		critical_enter();
+		ev = sensor_queue[sensor_tail];
+		sensor_tail = (sensor_tail + 1) % SENSOR_QUEUE;
+		critical_exit();
+
+		if (sensor_events)
+			gcode_sensor_event(ev.sensor, ev.val, ev.ms);
+	}
+}
+
+static void
+sensor_thread(void *arg)
+{
+	struct sensor *s;
+	uint32_t cycles;
+	uint32_t last;
+	int i;
+
+	last = board_get_cycles();
+
+	while (1) {
+		mdx_usleep(SENSOR_POLL);
+
+		/* The cycle counter wraps every 25 s, poll well within. */
+		cycles = board_get_cycles();
+		critical_enter();
+		sensor_us += (cycles - last) / (BOARD_CPU_FREQ / 1000000);
+		critical_exit();
+		last = cycles - (cycles - last) % (BOARD_CPU_FREQ / 1000000);
+
+		for (i = 0; i < SENSOR_COUNT; i++) {
+			s = &sensors[i];
+			if (sensor_sample(s) == s->state) {
+				s->count = 0;
+				continue;
+			}
+			if (++s->count < SENSOR_DEBOUNCE)
+				continue;
+			s->state = !s->state;
+			s->count = 0;
+			if (sensor_events)
+				sensor_push(i, s->state);
+		}
+	}
+}
+
+/* Debounced state of sensor 1 or 2. */
+int
+sensor_get(int sensor)
+{
+
+	return (sensors[sensor - 1].state);
+}
+
+/*
+ * Push every change from now on, or stop.  On start the current states
+ * are pushed first, for the host to start from.
+ */
+void
+sensor_subscribe(int enable)
+{
+	int i;
+
+	sensor_events = enable;
+
+	if (enable)
+		for (i = 0; i < SENSOR_COUNT; i++)
+			sensor_push(i, sensors[i].state);
+}
+
+int
+sensor_init(void)
+{
+	struct thread *td;
+	int i;
+
+	for (i = 0; i < SENSOR_COUNT; i++)
+		sensors[i].state = sensor_sample(&sensors[i]);
+
+	mdx_sem_init(&sensor_sem, 0);
+
+	td = mdx_thread_create("sensor ev", 1 /* prio */, 500 /* quantum */,
+	    1024 /* stack */, sensor_event_thread, NULL);
+	if (td == NULL) {
+		printf("%s: Failed to create event thread\n", __func__);
+		return (-1);
+	}
+
+	mdx_sched_add(td);
+
+	td = mdx_thread_create("sensor", 1 /* prio */, 500 /* quantum */,
+	    1024 /* stack */, sensor_thread, NULL);
+	if (td == NULL) {
+		printf("%s: Failed to create sensor thread\n", __func__);
+		return (-1);
+	}
+
+	mdx_sched_add(td);
+
+	return (0);
+}
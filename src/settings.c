@@ -0,0 +1,247 @@
+/*-
+ * Copyright (c) 2024 Ruslan Bukin <br@bsdpad.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The sector is written as a log: every save programs the next free
+ * record and the last valid one is current.  It is only erased once it
+ * is full, which stalls the CPU for a second or two, so saving is left
+ * to when the machine stands still.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/systm.h>
+
+#include <arm/stm/stm32f4.h>
+
+#include "settings.h"
+
+#define	RD4(_base, _reg)	(*(volatile uint32_t *)((_base) + (_reg)))
+#define	WR4(_base, _reg, _val)	\
+	(*(volatile uint32_t *)((_base) + (_reg)) = (_val))
+
+#define	SETTINGS_FLASH_KEYR	0x04
+#define	 FLASH_KEY1		0x45670123
+#define	 FLASH_KEY2		0xCDEF89AB
+#define	SETTINGS_FLASH_SR	0x0C
+#define	 FLASH_SR_EOP		(1 << 0)
+#define	 FLASH_SR_ERRS		(0xf << 4)	/* WRPERR..PGSERR */
+#define	 FLASH_SR_BSY		(1 << 16)
+#define	SETTINGS_FLASH_CR	0x10
+#define	 FLASH_CR_PG		(1 << 0)
+#define	 FLASH_CR_SER		(1 << 1)
+#define	 FLASH_CR_SNB_S		3
+#define	 FLASH_CR_PSIZE_32	(2 << 8)
+#define	 FLASH_CR_STRT		(1 << 16)
+#define	 FLASH_CR_LOCK		(1U << 31)
+
+#define	SETTINGS_MAGIC		0x53455432	/* SET2 */
+
+struct settings_rec {
+	uint32_t magic;
+	struct settings s;
+	uint32_t check;
+};
+
+#define	SETTINGS_WORDS		(sizeof(struct settings_rec) / 4)
+#define	SETTINGS_NRECS		(SETTINGS_SIZE / sizeof(struct settings_rec))
+
+/* The current settings, too large to be passed around on a stack. */
+static struct settings settings;
+
+static uint32_t
+settings_check(uint32_t magic, const struct settings *s)
+{
+	const uint32_t *w;
+	uint32_t sum;
+	int i;
+
+	w = (const uint32_t *)s;
+	sum = magic;
+	for (i = 0; i < sizeof(struct settings) / 4; i++)
+		sum += w[i];
+
+	return (~sum);
+}
+
+static const struct settings_rec *
+settings_rec(int i)
+{
+
+	return ((const struct settings_rec *)SETTINGS_BASE + i);
+}
+
+static int
+settings_erased(const struct settings_rec *rec)
+{
+	const uint32_t *w;
+	int i;
+
+	w = (const uint32_t *)rec;
+	for (i = 0; i < SETTINGS_WORDS; i++)
+		if (w[i] != 0xffffffff)
+			return (0);
+
+	return (1);
+}
+
+static int
+settings_flash_wait(void)
+{
+	uint32_t sr;
+
+	do
+		sr = RD4(FLASH_BASE, SETTINGS_FLASH_SR);
+	while (sr & FLASH_SR_BSY);
+
+	WR4(FLASH_BASE, SETTINGS_FLASH_SR, sr & (FLASH_SR_EOP | FLASH_SR_ERRS));
+
+	return ((sr & FLASH_SR_ERRS) ? -1 : 0);
+}
+
+static void
+settings_flash_unlock(void)
+{
+
+	if (RD4(FLASH_BASE, SETTINGS_FLASH_CR) & FLASH_CR_LOCK) {
+		WR4(FLASH_BASE, SETTINGS_FLASH_KEYR, FLASH_KEY1);
+		WR4(FLASH_BASE, SETTINGS_FLASH_KEYR, FLASH_KEY2);
+	}
+}
+
+static int
+settings_flash_erase(void)
+{
+
+	WR4(FLASH_BASE, SETTINGS_FLASH_CR, FLASH_CR_PSIZE_32 | FLASH_CR_SER |
+	    (SETTINGS_SECTOR << FLASH_CR_SNB_S));
+	WR4(FLASH_BASE, SETTINGS_FLASH_CR, RD4(FLASH_BASE, SETTINGS_FLASH_CR) |
+	    FLASH_CR_STRT);
+
+	return (settings_flash_wait());
+}
+
+/* Program a record: the magic, the settings and their check. */
+static int
+settings_flash_program(const struct settings_rec *dst, uint32_t magic,
+    const struct settings *s, uint32_t check)
+{
+	volatile uint32_t *d;
+	const uint32_t *w;
+	int error;
+	int i;
+
+	d = (volatile uint32_t *)(uintptr_t)dst;
+	w = (const uint32_t *)s;
+
+	WR4(FLASH_BASE, SETTINGS_FLASH_CR, FLASH_CR_PSIZE_32 | FLASH_CR_PG);
+
+	d[0] = magic;
+	error = settings_flash_wait();
+	for (i = 0; i < SETTINGS_WORDS - 2 && error == 0; i++) {
+		d[1 + i] = w[i];
+		error = settings_flash_wait();
+	}
+	if (error == 0) {
+		d[SETTINGS_WORDS - 1] = check;
+		error = settings_flash_wait();
+	}
+
+	WR4(FLASH_BASE, SETTINGS_FLASH_CR, 0);
+
+	return (error);
+}
+
+/*
+ * Read the saved settings into the current ones.  Returns -1 if none
+ * were ever saved, they are all zero then.
+ */
+int
+settings_load(void)
+{
+	const struct settings_rec *rec;
+	const struct settings_rec *last;
+	int i;
+
+	last = NULL;
+
+	for (i = 0; i < SETTINGS_NRECS; i++) {
+		rec = settings_rec(i);
+		if (rec->magic == 0xffffffff)
+			break;
+		if (rec->magic == SETTINGS_MAGIC &&
+		    rec->check == settings_check(rec->magic, &rec->s))
+			last = rec;
+	}
+
+	if (last == NULL) {
+		bzero(&settings, sizeof(struct settings));
+		return (-1);
+	}
+
+	settings = last->s;
+
+	return (0);
+}
+
+struct settings *
+settings_get(void)
+{
+
+	return (&settings);
+}
+
+/* Save the current settings. */
+int
+settings_save(void)
+{
+	uint32_t check;
+	int error;
+	int i;
+
+	check = settings_check(SETTINGS_MAGIC, &settings);
+
+	/* First record not written yet. */
+	for (i = 0; i < SETTINGS_NRECS; i++)
+		if (settings_rec(i)->magic == 0xffffffff)
+			break;
+
+	settings_flash_unlock();
+
+	if (i == SETTINGS_NRECS || !settings_erased(settings_rec(i))) {
+		error = settings_flash_erase();
+		if (error)
+			goto out;
+		i = 0;
+	}
+
+	error = settings_flash_program(settings_rec(i), SETTINGS_MAGIC,
+	    &settings, check);
+
+out:
+	WR4(FLASH_BASE, SETTINGS_FLASH_CR, FLASH_CR_LOCK);
+
+	return (error);
+}
@@ -0,0 +1,52 @@
+/*-
+ * Copyright (c) 2024 Ruslan Bukin <br@bsdpad.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SRC_SETTINGS_H_
+#define	_SRC_SETTINGS_H_
+
+/*
+ * Settings kept over a power cycle, in flash sector 7.  The sector is
+ * left out of the firmware image by the linker script.
+ */
+#define	SETTINGS_BASE		0x08060000
+#define	SETTINGS_SIZE		(128 * 1024)
+#define	SETTINGS_SECTOR		7
+
+#define	SETTINGS_MACROS		8
+#define	SETTINGS_MACRO_LEN	256
+
+struct settings {
+	uint32_t baud;		/* Preferred USART1 rate, 0 if none. */
+
+	/* Macro definitions as received, see M820. */
+	char macros[SETTINGS_MACROS][SETTINGS_MACRO_LEN];
+};
+
+int settings_load(void);
+struct settings *settings_get(void);
+int settings_save(void);
+
+#endif /* !_SRC_SETTINGS_H_ */
@@ -0,0 +1,114 @@
+/*-
+ * Copyright (c) 2024 Ruslan Bukin <br@bsdpad.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Input shapers for the gantry.
+ *
+ * A move is played as the sum of two or three copies of itself, delayed
+ * by half a period of the resonance each, so that the vibration excited
+ * by one copy is cancelled by the next.  ZV cancels the resonance at the
+ * given frequency only, ZVD and EI take longer but tolerate an error in
+ * the frequency, EI most.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/systm.h>
+
+#include <lib/msun/src/math.h>
+
+#include "shaper.h"
+
+#define	SHAPER_PI		3.14159265f
+
+/* Residual vibration the EI shaper is designed for. */
+#define	SHAPER_EI_VTOL		0.05f
+
+/*
+ * Resonance at freq Hz with the given damping ratio.  Returns 0 on
+ * success.
+ */
+int
+shaper_init(struct shaper *s, int type, float freq, float damping)
+{
+	float sum;
+	float df;
+	float td;
+	float k;
+	int i;
+
+	bzero(s, sizeof(struct shaper));
+
+	s->type = type;
+	s->freq = freq;
+	s->damping = damping;
+	s->n = 1;
+	s->a[0] = 1.0f;
+
+	if (type == SHAPER_NONE)
+		return (0);
+
+	if (freq <= 0.0f || damping < 0.0f || damping >= 1.0f)
+		return (-1);
+
+	df = sqrtf(1.0f - damping * damping);
+	k = expf(-damping * SHAPER_PI / df);
+	td = 1.0f / (freq * df);
+
+	switch (type) {
+	case SHAPER_ZV:
+		s->n = 2;
+		s->a[1] = k;
+		break;
+	case SHAPER_ZVD:
+		s->n = 3;
+		s->a[1] = 2.0f * k;
+		s->a[2] = k * k;
+		break;
+	case SHAPER_EI:
+		s->n = 3;
+		s->a[0] = 0.25f * (1.0f + SHAPER_EI_VTOL);
+		s->a[1] = 0.5f * (1.0f - SHAPER_EI_VTOL) * k;
+		s->a[2] = s->a[0] * k * k;
+		break;
+	default:
+		return (-1);
+	}
+
+	sum = 0.0f;
+	for (i = 0; i < s->n; i++) {
+		s->t[i] = 0.5f * td * i;
+		sum += s->a[i];
+	}
+
+	for (i = 0; i < s->n; i++) {
+		s->a[i] /= sum;
+		s->centroid += s->a[i] * s->t[i];
+	}
+
+	s->duration = s->t[s->n - 1];
+
+	return (0);
+}
@@ -0,0 +1,54 @@
+/*-
+ * Copyright (c) 2024 Ruslan Bukin <br@bsdpad.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SRC_SHAPER_H_
+#define	_SRC_SHAPER_H_
+
+#define	SHAPER_NONE		0
+#define	SHAPER_ZV		1
+#define	SHAPER_ZVD		2
+#define	SHAPER_EI		3
+
+#define	SHAPER_MAX_IMPULSES	3
+
+/*
+ * Input shaper: the commanded position is replaced by the sum of delayed
+ * copies of it, scaled by the impulse amplitudes.
+ */
+struct shaper {
+	int type;
+	int n;
+	float a[SHAPER_MAX_IMPULSES];	/* Amplitudes, they sum up to 1. */
+	float t[SHAPER_MAX_IMPULSES];	/* Delays, s. */
+	float centroid;			/* Mean delay, s. */
+	float duration;			/* Delay of the last impulse, s. */
+	float freq;			/* As given, Hz. */
+	float damping;
+};
+
+int shaper_init(struct shaper *s, int type, float freq, float damping);
+
+#endif /* !_SRC_SHAPER_H_ */
@@ -0,0 +1,518 @@
+/*-
+ * Copyright (c) 2024 Ruslan Bukin <br@bsdpad.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/systm.h>
+
+#include "stepgen.h"
+
+/* General-purpose timer registers (TIM4, TIM10, TIM12-14). */
+#define	SG_TIM_CR1		0x00
+#define	 TIM_CR1_CEN		(1 << 0)
+#define	 TIM_CR1_URS		(1 << 2)
+#define	 TIM_CR1_OPM		(1 << 3)
+#define	 TIM_CR1_ARPE		(1 << 7)
+#define	SG_TIM_DIER		0x0C
+#define	 TIM_DIER_UIE		(1 << 0)
+#define	 TIM_DIER_UDE		(1 << 8)
+#define	SG_TIM_SR		0x10
+#define	SG_TIM_EGR		0x14
+#define	 TIM_EGR_UG		(1 << 0)
+#define	SG_TIM_CCMR1		0x18
+#define	 TIM_CCMR1_OC1PE	(1 << 3)
+#define	 TIM_CCMR1_OC1M_PWM1	(6 << 4)
+#define	 TIM_CCMR1_OC2PE	(1 << 11)
+#define	 TIM_CCMR1_OC2M_PWM1	(6 << 12)
+#define	SG_TIM_CCER		0x20
+#define	 TIM_CCER_CC1E		(1 << 0)
+#define	 TIM_CCER_CC2E		(1 << 4)
+#define	SG_TIM_CNT		0x24
+#define	SG_TIM_PSC		0x28
+#define	SG_TIM_ARR		0x2C
+#define	SG_TIM_CCR1		0x34
+#define	SG_TIM_CCR2		0x38
+#define	SG_TIM_DCR		0x48
+#define	 TIM_DCR_DBA_S		0
+#define	 TIM_DCR_DBL_S		8
+#define	SG_TIM_DMAR		0x4C
+
+/* DMA controller registers. */
+#define	SG_DMA_LISR		0x00
+#define	SG_DMA_HISR		0x04
+#define	SG_DMA_LIFCR		0x08
+#define	SG_DMA_HIFCR		0x0C
+#define	SG_DMA_SCR(n)		(0x10 + 0x18 * (n))
+#define	 DMA_SCR_EN		(1 << 0)
+#define	 DMA_SCR_TEIE		(1 << 2)
+#define	 DMA_SCR_TCIE		(1 << 4)
+#define	 DMA_SCR_DIR_M2P	(1 << 6)
+#define	 DMA_SCR_MINC		(1 << 10)
+#define	 DMA_SCR_PSIZE_16	(1 << 11)
+#define	 DMA_SCR_MSIZE_16	(1 << 13)
+#define	 DMA_SCR_PL_HIGH	(2 << 16)
+#define	 DMA_SCR_DBM		(1 << 18)
+#define	 DMA_SCR_CT		(1 << 19)
+#define	 DMA_SCR_CHSEL_S	25
+#define	SG_DMA_SNDTR(n)		(0x14 + 0x18 * (n))
+#define	SG_DMA_SPAR(n)		(0x18 + 0x18 * (n))
+#define	SG_DMA_SM0AR(n)		(0x1C + 0x18 * (n))
+#define	SG_DMA_SM1AR(n)		(0x20 + 0x18 * (n))
+#define	 DMA_FLAGS_ALL		0x3d	/* FEIF | DMEIF | TEIF | HTIF | TCIF */
+#define	 DMA_FLAG_TEIF		(1 << 3)
+#define	 DMA_FLAG_TCIF		(1 << 5)
+
+/* Words per entry: ARR, RCR, CCR1, CCR2. */
+#define	SG_BURST		4
+
+/* Idle cycles played before the table, see stepgen_prepare(). */
+#define	SG_LEAD_TICKS		40
+
+#define	RD4(_base, _reg)	(*(volatile uint32_t *)((_base) + (_reg)))
+#define	WR4(_base, _reg, _val)	\
+	(*(volatile uint32_t *)((_base) + (_reg)) = (_val))
+
+static int
+stepgen_dma_shift(int stream)
+{
+	static const int shift[4] = { 0, 6, 16, 22 };
+
+	return (shift[stream & 3]);
+}
+
+static uint32_t
+stepgen_dma_flags(struct stepgen *sg)
+{
+	uint32_t reg;
+
+	reg = sg->dma_stream < 4 ? SG_DMA_LISR : SG_DMA_HISR;
+
+	return ((RD4(sg->dma_base, reg) >> stepgen_dma_shift(sg->dma_stream))
+	    & DMA_FLAGS_ALL);
+}
+
+static void
+stepgen_dma_clear(struct stepgen *sg, uint32_t flags)
+{
+	uint32_t reg;
+
+	reg = sg->dma_stream < 4 ? SG_DMA_LIFCR : SG_DMA_HIFCR;
+
+	WR4(sg->dma_base, reg, flags << stepgen_dma_shift(sg->dma_stream));
+}
+
+static void
+stepgen_dma_disable(struct stepgen *sg)
+{
+	int n;
+
+	n = sg->dma_stream;
+
+	WR4(sg->dma_base, SG_DMA_SCR(n),
+	    RD4(sg->dma_base, SG_DMA_SCR(n)) & ~DMA_SCR_EN);
+	while (RD4(sg->dma_base, SG_DMA_SCR(n)) & DMA_SCR_EN)
+		;
+	stepgen_dma_clear(sg, DMA_FLAGS_ALL);
+}
+
+/*
+ * Stream the ring into TIMx_ARR..TIMx_CCR2 through the DMAR burst
+ * window, one entry per update event.  Double-buffer mode switches
+ * between the halves by itself, so the CPU is only involved once per
+ * half.
+ */
+static void
+stepgen_dma_start(struct stepgen *sg)
+{
+	uint32_t reg;
+	int n;
+
+	n = sg->dma_stream;
+
+	stepgen_dma_disable(sg);
+
+	WR4(sg->base, SG_TIM_DCR, ((SG_TIM_ARR / 4) << TIM_DCR_DBA_S) |
+	    ((SG_BURST - 1) << TIM_DCR_DBL_S));
+
+	WR4(sg->dma_base, SG_DMA_SPAR(n), sg->base + SG_TIM_DMAR);
+	WR4(sg->dma_base, SG_DMA_SM0AR(n), (uintptr_t)&sg->ring[0]);
+	WR4(sg->dma_base, SG_DMA_SM1AR(n), (uintptr_t)&sg->ring[STEPGEN_HALF]);
+	WR4(sg->dma_base, SG_DMA_SNDTR(n), STEPGEN_HALF * SG_BURST);
+
+	reg = sg->dma_channel << DMA_SCR_CHSEL_S;
+	reg |= DMA_SCR_DBM | DMA_SCR_PL_HIGH;
+	reg |= DMA_SCR_MSIZE_16 | DMA_SCR_PSIZE_16 | DMA_SCR_MINC;
+	reg |= DMA_SCR_DIR_M2P | DMA_SCR_TCIE | DMA_SCR_TEIE;
+	WR4(sg->dma_base, SG_DMA_SCR(n), reg);
+	WR4(sg->dma_base, SG_DMA_SCR(n), reg | DMA_SCR_EN);
+}
+
+/*
+ * Ring index of the entry the DMA wrote to the timer last.  Memory 0 is
+ * half 0 and memory 1 is half 1.
+ */
+static int
+stepgen_dma_last(struct stepgen *sg)
+{
+	uint32_t cnt;
+	int half;
+	int n;
+
+	n = sg->dma_stream;
+
+	half = (RD4(sg->dma_base, SG_DMA_SCR(n)) & DMA_SCR_CT) ? 1 : 0;
+	cnt = RD4(sg->dma_base, SG_DMA_SNDTR(n)) / SG_BURST;
+	if (cnt == STEPGEN_HALF)
+		/* Just switched, nothing taken from this half yet. */
+		return (!half * STEPGEN_HALF + STEPGEN_HALF - 1);
+
+	return (half * STEPGEN_HALF + (STEPGEN_HALF - cnt) - 1);
+}
+
+void
+stepgen_init(struct stepgen *sg, uint32_t base, int chanset)
+{
+
+	bzero(sg, sizeof(struct stepgen));
+
+	sg->base = base;
+	sg->chanset = chanset;
+	sg->stop[0] = -1;
+	sg->stop[1] = -1;
+}
+
+void
+stepgen_init_dma(struct stepgen *sg, uint32_t dma_base, int stream,
+    int channel)
+{
+
+	sg->dma_base = dma_base;
+	sg->dma_stream = stream;
+	sg->dma_channel = channel;
+}
+
+/*
+ * Describe timer cycle idx: ticks long, starting with a step pulse if
+ * requested.
+ */
+void
+stepgen_put(struct stepgen *sg, int idx, uint32_t ticks, int pulse)
+{
+	struct stepgen_entry *e;
+	uint16_t ccr;
+
+	if (ticks > STEPGEN_MAX_TICKS)
+		ticks = STEPGEN_MAX_TICKS;
+	if (ticks < STEPGEN_PULSE_TICKS * 2)
+		ticks = STEPGEN_PULSE_TICKS * 2;
+
+	ccr = pulse ? STEPGEN_PULSE_TICKS : 0;
+
+	e = &sg->ring[idx];
+	e->arr = ticks - 1;
+	e->rcr = 0;
+	e->ccr1 = ccr;
+	e->ccr2 = ccr;
+}
+
+/*
+ * Switch the direction before the step of cycle idx.  The pin is set
+ * from the interrupt that loads the entry, at the start of the cycle
+ * before it, so that one must not pulse and has to be long enough for
+ * the direction setup time of the driver.  Not available on trains fed
+ * by DMA.
+ */
+void
+stepgen_put_dir(struct stepgen *sg, int idx, int dir)
+{
+
+	sg->ring[idx].rcr = STEPGEN_E_DIR | (dir ? STEPGEN_E_DIR_POS : 0);
+}
+
+/*
+ * Hand a filled half over to the consumer.  steps is the position change
+ * it makes, signed, and is handed back through update() once the half
+ * is played.  stop is the ring index of the entry the train ends on (-1
+ * if it continues into the other half).  The stop entry itself is never
+ * played and must not pulse.
+ */
+void
+stepgen_ready(struct stepgen *sg, int half, int steps, int stop)
+{
+
+	sg->steps[half] = steps;
+	sg->stop[half] = stop;
+	sg->ready[half] = 1;
+}
+
+static void
+stepgen_finish(struct stepgen *sg)
+{
+
+	WR4(sg->base, SG_TIM_DIER, 0);
+	WR4(sg->base, SG_TIM_CR1, 0);
+	WR4(sg->base, SG_TIM_SR, 0);
+	if (sg->dma)
+		stepgen_dma_disable(sg);
+
+	sg->ready[0] = 0;
+	sg->ready[1] = 0;
+	sg->stop[0] = -1;
+	sg->stop[1] = -1;
+	sg->running = 0;
+
+	sg->done(sg->arg, sg->error);
+}
+
+/* Stop right now, dropping whatever the ring still holds. */
+static void
+stepgen_abort(struct stepgen *sg, int error)
+{
+
+	sg->error = error;
+	stepgen_finish(sg);
+}
+
+/*
+ * Let the current cycle complete, then stop the counter.  Nothing is fed
+ * any more and the preloaded cycle has no pulse, so the output stays low
+ * once the counter stops.
+ */
+static void
+stepgen_stop_after_current(struct stepgen *sg)
+{
+
+	WR4(sg->base, SG_TIM_DIER, TIM_DIER_UIE);
+	WR4(sg->base, SG_TIM_CCR1, 0);
+	WR4(sg->base, SG_TIM_CCR2, 0);
+	WR4(sg->base, SG_TIM_CR1, RD4(sg->base, SG_TIM_CR1) | TIM_CR1_OPM);
+	sg->stopping = 1;
+}
+
+/*
+ * Get ready to play the ring from the beginning of half 0.  Both halves
+ * (or the one holding the stop entry) must be ready.
+ *
+ * The preload registers always hold the next cycle, so two idle lead
+ * cycles are played first: the first is loaded right away, the second
+ * sits in the preload registers until the first update, where the DMA
+ * or the interrupt handler writes the first ring entry.
+ */
+void
+stepgen_prepare(struct stepgen *sg)
+{
+	uint32_t ccmr;
+	uint32_t ccer;
+
+	sg->next = 0;
+	sg->stopping = 0;
+	sg->error = 0;
+	sg->running = 1;
+
+	/*
+	 * Watching for a condition or changing direction needs the
+	 * interrupt on every update.
+	 */
+	sg->dma = sg->dma_base != 0 && sg->check == NULL && sg->intr == 0;
+
+	ccmr = ccer = 0;
+	if (sg->chanset & (1 << 0)) {
+		ccmr |= TIM_CCMR1_OC1M_PWM1 | TIM_CCMR1_OC1PE;
+		ccer |= TIM_CCER_CC1E;
+	}
+	if (sg->chanset & (1 << 1)) {
+		ccmr |= TIM_CCMR1_OC2M_PWM1 | TIM_CCMR1_OC2PE;
+		ccer |= TIM_CCER_CC2E;
+	}
+
+	WR4(sg->base, SG_TIM_CR1, 0);
+	WR4(sg->base, SG_TIM_DIER, 0);
+	WR4(sg->base, SG_TIM_PSC, STEPGEN_PSC - 1);
+	WR4(sg->base, SG_TIM_CCMR1, ccmr);
+	WR4(sg->base, SG_TIM_CCER, ccer);
+	WR4(sg->base, SG_TIM_CCR1, 0);
+	WR4(sg->base, SG_TIM_CCR2, 0);
+	WR4(sg->base, SG_TIM_ARR, SG_LEAD_TICKS - 1);
+	WR4(sg->base, SG_TIM_CR1, TIM_CR1_URS | TIM_CR1_ARPE);
+	WR4(sg->base, SG_TIM_CNT, 0);
+	WR4(sg->base, SG_TIM_EGR, TIM_EGR_UG);
+	WR4(sg->base, SG_TIM_SR, 0);
+
+	if (sg->dma) {
+		stepgen_dma_start(sg);
+		/* Track the stop entry per update if it is in this half. */
+		WR4(sg->base, SG_TIM_DIER, TIM_DIER_UDE |
+		    (sg->stop[0] >= 0 ? TIM_DIER_UIE : 0));
+	} else
+		WR4(sg->base, SG_TIM_DIER, TIM_DIER_UIE);
+}
+
+/* Start the counter of a prepared generator. */
+void
+stepgen_enable(struct stepgen *sg)
+{
+
+	WR4(sg->base, SG_TIM_CR1, TIM_CR1_URS | TIM_CR1_ARPE | TIM_CR1_CEN);
+}
+
+/* Number of step pulses in ring entries [from, to). */
+static int
+stepgen_count(struct stepgen *sg, int from, int to)
+{
+	int pulses;
+	int i;
+
+	pulses = 0;
+	for (i = from; i < to; i++)
+		if (sg->ring[i].ccr1 != 0 || sg->ring[i].ccr2 != 0)
+			pulses += 1;
+
+	return (pulses);
+}
+
+static void
+stepgen_load(struct stepgen *sg, int idx)
+{
+	struct stepgen_entry *e;
+
+	e = &sg->ring[idx];
+
+	WR4(sg->base, SG_TIM_ARR, e->arr);
+	WR4(sg->base, SG_TIM_CCR1, e->ccr1);
+	WR4(sg->base, SG_TIM_CCR2, e->ccr2);
+
+	if (e->rcr & STEPGEN_E_DIR)
+		sg->set_dir(sg->arg, (e->rcr & STEPGEN_E_DIR_POS) ? 1 : 0);
+}
+
+/* Timer update interrupt. */
+void
+stepgen_intr(struct stepgen *sg)
+{
+	int steps;
+	int half;
+	int idx;
+
+	WR4(sg->base, SG_TIM_SR, 0);
+
+	if (sg->running == 0)
+		return;
+
+	if ((RD4(sg->base, SG_TIM_CR1) & TIM_CR1_CEN) == 0) {
+		/* The last cycle is over. */
+		stepgen_finish(sg);
+		return;
+	}
+
+	if (sg->stopping)
+		return;
+
+	if (sg->dma) {
+		/* Only enabled while the stop entry is in flight. */
+		idx = stepgen_dma_last(sg);
+		half = idx / STEPGEN_HALF;
+		if (sg->stop[half] >= 0 && idx >= sg->stop[half]) {
+			sg->update(sg->arg, sg->steps[half]);
+			stepgen_stop_after_current(sg);
+		}
+		return;
+	}
+
+	idx = sg->next;
+	half = idx / STEPGEN_HALF;
+
+	if (sg->check != NULL && sg->check(sg->arg)) {
+		/*
+		 * Stop early, report the pulses loaded from this half.  The
+		 * train keeps its direction, so the sign is that of the half.
+		 */
+		steps = stepgen_count(sg, half * STEPGEN_HALF, idx);
+		sg->update(sg->arg, sg->steps[half] < 0 ? -steps : steps);
+		stepgen_stop_after_current(sg);
+		return;
+	}
+
+	if ((idx % STEPGEN_HALF) == 0 && sg->ready[half] == 0) {
+		stepgen_abort(sg, STEPGEN_ERR_UNDERRUN);
+		return;
+	}
+
+	stepgen_load(sg, idx);
+
+	if (idx == sg->stop[half]) {
+		sg->update(sg->arg, sg->steps[half]);
+		stepgen_stop_after_current(sg);
+		return;
+	}
+
+	sg->next = (idx + 1) % STEPGEN_RING;
+	if ((sg->next % STEPGEN_HALF) == 0) {
+		sg->ready[half] = 0;
+		sg->stop[half] = -1;
+		sg->update(sg->arg, sg->steps[half]);
+	}
+}
+
+/* DMA transfer complete: a half has been handed to the timer. */
+void
+stepgen_dma_intr(struct stepgen *sg)
+{
+	uint32_t flags;
+	int half;
+
+	flags = stepgen_dma_flags(sg);
+	stepgen_dma_clear(sg, flags);
+
+	if (sg->running == 0 || sg->stopping)
+		return;
+
+	if (flags & DMA_FLAG_TEIF) {
+		stepgen_abort(sg, STEPGEN_ERR_UNDERRUN);
+		return;
+	}
+
+	if ((flags & DMA_FLAG_TCIF) == 0)
+		return;
+
+	/*
+	 * sg->next holds the half the DMA was working on.  If the train
+	 * ends in it the update handler deals with the stop, otherwise hand
+	 * it back to the producer.
+	 */
+	half = sg->next;
+	if (sg->stop[half] >= 0)
+		return;
+	sg->next = !half;
+	sg->ready[half] = 0;
+	sg->update(sg->arg, sg->steps[half]);
+
+	if (sg->ready[!half] == 0) {
+		stepgen_abort(sg, STEPGEN_ERR_UNDERRUN);
+		return;
+	}
+
+	if (sg->stop[!half] >= 0)
+		WR4(sg->base, SG_TIM_DIER, TIM_DIER_UDE | TIM_DIER_UIE);
+}
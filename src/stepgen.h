@@ -0,0 +1,110 @@
+/*-
+ * Copyright (c) 2024 Ruslan Bukin <br@bsdpad.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SRC_STEPGEN_H_
+#define	_SRC_STEPGEN_H_
+
+/*
+ * Step pulse trains from precomputed period tables.
+ *
+ * The motor timer runs in PWM mode with ARR/CCR preload.  Every timer
+ * cycle is described by one ring entry: its length and whether it
+ * starts with a step pulse.  Entries are fed either by DMA on the update
+ * event (TIM4) or from the update interrupt (timers that have no DMA
+ * request).  The ring is split into two halves: while one is being
+ * played the producer refills the other one.
+ */
+
+#define	STEPGEN_TIMER_FREQ	84000000
+#define	STEPGEN_PSC		21
+#define	STEPGEN_TICK_FREQ	(STEPGEN_TIMER_FREQ / STEPGEN_PSC) /* 4MHz */
+#define	STEPGEN_PULSE_TICKS	8	/* 2us step pulse. */
+#define	STEPGEN_MAX_TICKS	65536
+#define	STEPGEN_STOP_TICKS	1000
+#define	STEPGEN_HALF		64
+#define	STEPGEN_RING		(STEPGEN_HALF * 2)
+
+/* One timer cycle, laid out as the TIMx_ARR..TIMx_CCR2 DMA burst. */
+struct stepgen_entry {
+	uint16_t arr;
+	uint16_t rcr;		/* Reserved slot on general-purpose timers. */
+	uint16_t ccr1;
+	uint16_t ccr2;
+};
+
+/* Entry flags, kept in the rcr slot of trains fed from the interrupt. */
+#define	STEPGEN_E_DIR		(1 << 0)	/* Set the direction first. */
+#define	STEPGEN_E_DIR_POS	(1 << 1)	/* Towards +. */
+
+struct stepgen {
+	uint32_t base;		/* Timer. */
+	int chanset;
+	uint32_t dma_base;	/* 0 if fed from the update interrupt. */
+	int dma_stream;
+	int dma_channel;
+
+	struct stepgen_entry ring[STEPGEN_RING];
+
+	/* Producer state, per half. */
+	volatile int ready[2];
+	int steps[2];
+	int stop[2];		/* Ring index of the stop entry, or -1. */
+
+	/* Consumer state. */
+	volatile int running;
+	int next;
+	int stopping;
+	int error;
+#define	STEPGEN_ERR_UNDERRUN	1
+
+	int dma;		/* Fed by DMA in this train. */
+	int intr;		/* Feed the next train from the interrupt. */
+
+	void (*update)(void *arg, int steps);
+	void (*done)(void *arg, int error);
+	void (*set_dir)(void *arg, int dir);
+	/*
+	 * Optional, polled on every update.  A non-zero return ends the
+	 * train after the current cycle.  Trains that have one are fed
+	 * from the update interrupt even if DMA is available, and must not
+	 * change direction.
+	 */
+	int (*check)(void *arg);
+	void *arg;
+};
+
+void stepgen_init(struct stepgen *sg, uint32_t base, int chanset);
+void stepgen_init_dma(struct stepgen *sg, uint32_t dma_base, int stream,
+    int channel);
+void stepgen_put(struct stepgen *sg, int idx, uint32_t ticks, int pulse);
+void stepgen_put_dir(struct stepgen *sg, int idx, int dir);
+void stepgen_ready(struct stepgen *sg, int half, int steps, int stop);
+void stepgen_prepare(struct stepgen *sg);
+void stepgen_enable(struct stepgen *sg);
+void stepgen_intr(struct stepgen *sg);
+void stepgen_dma_intr(struct stepgen *sg);
+
+#endif /* !_SRC_STEPGEN_H_ */
@@ -85,6 +85,37 @@ trig_translate_z(float z0, float cam_radius, int *result)
 	return (0);
 }
 
+/*
+ * Rate of the cam at the given motor angle: degrees of rotation per unit
+ * of z, in the units of cam_radius.  The nozzle barely moves at the ends
+ * of the cam, where the rate has no bound and 0 is returned.
+ */
+float
+trig_rate_z(float deg, float cam_radius)
+{
+	float s;
+
+	s = sinf(RAD(fabsf(deg)));
+	if (s < 0.001f)
+		return (0.0f);
+
+	return (DEG(1.0f / (cam_radius * s)));
+}
+
+/*
+ * Nozzle travel at the given motor angle, in degrees, the inverse of
+ * trig_translate_z().  In the units of cam_radius.
+ */
+float
+trig_position_z(float deg, float cam_radius)
+{
+	float z;
+
+	z = cam_radius * (1.0f + sinf(RAD(fabsf(deg) - 90.0f)));
+
+	return (deg < 0.0f ? -z : z);
+}
+
 void
 trig_test(void)
 {
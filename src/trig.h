@@ -28,6 +28,8 @@
 #define	_SRC_TRIG_H_
 
 int trig_translate_z(float z, float cam_radius, int *result);
+float trig_rate_z(float deg, float cam_radius);
+float trig_position_z(float deg, float cam_radius);
 void trig_test(void);
 
 #endif /* !_SRC_TRIG_H_ */
@@ -0,0 +1,322 @@
+/*-
+ * Copyright (c) 2024 Ruslan Bukin <br@bsdpad.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/systm.h>
+#include <sys/sem.h>
+
+#include "uart.h"
+
+#define	RD4(_base, _reg)	(*(volatile uint32_t *)((_base) + (_reg)))
+#define	WR4(_base, _reg, _val)	\
+	(*(volatile uint32_t *)((_base) + (_reg)) = (_val))
+
+#define	UART_DR			0x04
+#define	UART_CR3		0x14
+#define	 CR3_DMAT		(1 << 7)
+
+#define	UART_DMA_LISR		0x00
+#define	UART_DMA_HISR		0x04
+#define	UART_DMA_LIFCR		0x08
+#define	UART_DMA_HIFCR		0x0C
+#define	UART_DMA_SCR(n)		(0x10 + 0x18 * (n))
+#define	 DMA_SCR_EN		(1 << 0)
+#define	 DMA_SCR_TEIE		(1 << 2)
+#define	 DMA_SCR_TCIE		(1 << 4)
+#define	 DMA_SCR_DIR_M2P	(1 << 6)
+#define	 DMA_SCR_MINC		(1 << 10)
+#define	 DMA_SCR_CHSEL_S	25
+#define	UART_DMA_SNDTR(n)	(0x14 + 0x18 * (n))
+#define	UART_DMA_SPAR(n)	(0x18 + 0x18 * (n))
+#define	UART_DMA_SM0AR(n)	(0x1C + 0x18 * (n))
+#define	 DMA_FLAGS_ALL		0x3d	/* FEIF | DMEIF | TEIF | HTIF | TCIF */
+#define	 DMA_FLAG_TEIF		(1 << 3)
+#define	 DMA_FLAG_TCIF		(1 << 5)
+
+static int
+uart_dma_shift(int stream)
+{
+	static const int shift[4] = { 0, 6, 16, 22 };
+
+	return (shift[stream & 3]);
+}
+
+static void
+uart_dma_clear(struct uart_tx *tx)
+{
+	uint32_t reg;
+
+	reg = tx->dma_stream < 4 ? UART_DMA_LIFCR : UART_DMA_HIFCR;
+
+	WR4(tx->dma_base, reg, DMA_FLAGS_ALL << uart_dma_shift(tx->dma_stream));
+}
+
+/*
+ * Send what is queued up to the end of the ring, the rest goes once
+ * that is done.  Called with interrupts off.
+ */
+static void
+uart_tx_start(struct uart_tx *tx)
+{
+	int n;
+
+	if (tx->len != 0 || tx->head == tx->tail)
+		return;
+
+	if (tx->head > tx->tail)
+		tx->len = tx->head - tx->tail;
+	else
+		tx->len = UART_TX_SIZE - tx->tail;
+
+	n = tx->dma_stream;
+
+	uart_dma_clear(tx);
+	WR4(tx->dma_base, UART_DMA_SM0AR(n), (uintptr_t)&tx->ring[tx->tail]);
+	WR4(tx->dma_base, UART_DMA_SNDTR(n), tx->len);
+	WR4(tx->dma_base, UART_DMA_SCR(n),
+	    (tx->dma_channel << DMA_SCR_CHSEL_S) | DMA_SCR_MINC |
+	    DMA_SCR_DIR_M2P | DMA_SCR_TCIE | DMA_SCR_TEIE | DMA_SCR_EN);
+}
+
+void
+uart_tx_init(struct uart_tx *tx, uint32_t base, uint32_t dma_base,
+    int dma_stream, int dma_channel, int block)
+{
+
+	bzero(tx, sizeof(struct uart_tx));
+
+	tx->base = base;
+	tx->dma_base = dma_base;
+	tx->dma_stream = dma_stream;
+	tx->dma_channel = dma_channel;
+	tx->bol = 1;
+	tx->block = block;
+	mdx_sem_init(&tx->room_sem, 0);
+
+	WR4(dma_base, UART_DMA_SCR(dma_stream), 0);
+	while (RD4(dma_base, UART_DMA_SCR(dma_stream)) & DMA_SCR_EN)
+		;
+	WR4(dma_base, UART_DMA_SPAR(dma_stream), base + UART_DR);
+	uart_dma_clear(tx);
+
+	WR4(base, UART_CR3, RD4(base, UART_CR3) | CR3_DMAT);
+}
+
+/*
+ * Whether the caller may wait for the DMA interrupt to make room: a
+ * thread, with interrupts on.
+ */
+static int
+uart_tx_can_wait(struct uart_tx *tx)
+{
+	uint32_t primask;
+	uint32_t ipsr;
+
+	if (tx->block == 0)
+		return (0);
+
+	__asm __volatile("mrs %0, ipsr" : "=r" (ipsr));
+	__asm __volatile("mrs %0, primask" : "=r" (primask));
+
+	return (ipsr == 0 && (primask & 1) == 0);
+}
+
+static int
+uart_tx_room(struct uart_tx *tx)
+{
+
+	return ((tx->tail - tx->head - 1 + UART_TX_SIZE) % UART_TX_SIZE);
+}
+
+/*
+ * Sleep until the DMA interrupt has sent a chunk.  Called with
+ * interrupts off, which are turned back on while asleep.
+ */
+static void
+uart_tx_sleep(struct uart_tx *tx)
+{
+
+	tx->waiters += 1;
+	critical_exit();
+	mdx_sem_wait(&tx->room_sem);
+	critical_enter();
+}
+
+/*
+ * Make room for len characters.  Called with interrupts off, which are
+ * turned back on while waiting.  Returns -1 if there is no room and the
+ * caller can't wait, the characters are counted as dropped then.
+ */
+static int
+uart_tx_reserve(struct uart_tx *tx, int len, int wait)
+{
+
+	while (uart_tx_room(tx) < len) {
+		if (wait == 0 || len >= UART_TX_SIZE) {
+			tx->overflows += len;
+			return (-1);
+		}
+		uart_tx_sleep(tx);
+	}
+
+	return (0);
+}
+
+/*
+ * Queue a character.  The transfer starts right away if the line is
+ * idle, characters queued meanwhile go out together after it.
+ */
+void
+uart_tx_putc(struct uart_tx *tx, int c)
+{
+	int wait;
+
+	wait = uart_tx_can_wait(tx);
+
+	critical_enter();
+
+	if (uart_tx_reserve(tx, 1, wait) != 0) {
+		critical_exit();
+		return;
+	}
+
+	tx->ring[tx->head] = c;
+	tx->head = (tx->head + 1) % UART_TX_SIZE;
+	tx->bol = (c == '\n');
+
+	uart_tx_start(tx);
+
+	critical_exit();
+}
+
+/* Queue the whole buffer, there is room for it. */
+static void
+uart_tx_queue(struct uart_tx *tx, const uint8_t *buf, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		tx->ring[tx->head] = buf[i];
+		tx->head = (tx->head + 1) % UART_TX_SIZE;
+	}
+
+	if (len > 0)
+		tx->bol = (buf[len - 1] == '\n');
+
+	uart_tx_start(tx);
+}
+
+/* Queue the whole buffer or, if it can't wait for room, none of it. */
+void
+uart_tx_write(struct uart_tx *tx, const uint8_t *buf, int len)
+{
+	int wait;
+
+	wait = uart_tx_can_wait(tx);
+
+	critical_enter();
+	if (uart_tx_reserve(tx, len, wait) == 0)
+		uart_tx_queue(tx, buf, len);
+	critical_exit();
+}
+
+/*
+ * The same, but only between lines: returns -1 and queues nothing while
+ * a line printed character by character is not over yet.
+ */
+int
+uart_tx_write_line(struct uart_tx *tx, const uint8_t *buf, int len)
+{
+	int wait;
+
+	wait = uart_tx_can_wait(tx);
+
+	critical_enter();
+	if (tx->bol == 0) {
+		critical_exit();
+		return (-1);
+	}
+	/* Others may print while it waits, check again once there is room. */
+	if (uart_tx_reserve(tx, len, wait) == 0) {
+		if (tx->bol == 0) {
+			critical_exit();
+			return (-1);
+		}
+		uart_tx_queue(tx, buf, len);
+	}
+	critical_exit();
+
+	return (0);
+}
+
+/*
+ * Wait until everything queued has been sent, before a reset or when the
+ * output has to be out before going on.  Needs interrupts on, a caller
+ * that can't sleep spins.
+ */
+void
+uart_tx_flush(struct uart_tx *tx)
+{
+
+	if (uart_tx_can_wait(tx) == 0) {
+		while (tx->head != tx->tail)
+			;
+		return;
+	}
+
+	critical_enter();
+	while (tx->head != tx->tail)
+		uart_tx_sleep(tx);
+	critical_exit();
+}
+
+/* DMA stream interrupt: the transfer in flight is over. */
+void
+uart_tx_intr(struct uart_tx *tx)
+{
+	uint32_t flags;
+	uint32_t reg;
+
+	reg = tx->dma_stream < 4 ? UART_DMA_LISR : UART_DMA_HISR;
+	flags = (RD4(tx->dma_base, reg) >> uart_dma_shift(tx->dma_stream)) &
+	    DMA_FLAGS_ALL;
+	if ((flags & (DMA_FLAG_TCIF | DMA_FLAG_TEIF)) == 0)
+		return;
+
+	uart_dma_clear(tx);
+
+	/* On an error the chunk is lost all the same. */
+	tx->tail = (tx->tail + tx->len) % UART_TX_SIZE;
+	tx->len = 0;
+
+	uart_tx_start(tx);
+
+	/* Each one checks again whether there is enough room now. */
+	while (tx->waiters > 0) {
+		tx->waiters -= 1;
+		mdx_sem_post(&tx->room_sem);
+	}
+}
@@ -0,0 +1,65 @@
+/*-
+ * Copyright (c) 2024 Ruslan Bukin <br@bsdpad.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SRC_UART_H_
+#define	_SRC_UART_H_
+
+/*
+ * Console output through a ring buffer that DMA drains into the USART,
+ * so that printing does not wait for the line while there is room.  A
+ * full ring makes a blocking writer sleep until the DMA interrupt has
+ * made room, unless it is an interrupt handler or has interrupts off.
+ * Characters that can't wait are dropped and counted.
+ */
+
+#define	UART_TX_SIZE		2048
+
+struct uart_tx {
+	uint32_t base;		/* USART. */
+	uint32_t dma_base;
+	int dma_stream;
+	int dma_channel;
+
+	uint8_t ring[UART_TX_SIZE];
+	volatile int head;	/* Next free. */
+	volatile int tail;	/* Next to send. */
+	volatile int len;	/* In flight, 0 if DMA is idle. */
+	volatile uint32_t overflows;
+	volatile int bol;	/* The last character queued ended a line. */
+	int block;		/* Writers wait for room, see above. */
+	mdx_sem_t room_sem;	/* Posted once per waiter as room is made. */
+	volatile int waiters;
+};
+
+void uart_tx_init(struct uart_tx *tx, uint32_t base, uint32_t dma_base,
+    int dma_stream, int dma_channel, int block);
+void uart_tx_putc(struct uart_tx *tx, int c);
+void uart_tx_write(struct uart_tx *tx, const uint8_t *buf, int len);
+int uart_tx_write_line(struct uart_tx *tx, const uint8_t *buf, int len);
+void uart_tx_flush(struct uart_tx *tx);
+void uart_tx_intr(struct uart_tx *tx);
+
+#endif /* !_SRC_UART_H_ */